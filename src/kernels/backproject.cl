@@ -17,12 +17,27 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* Samples off the detector read the zero border of the clamp mode */
 constant sampler_t volumeSampler = CLK_NORMALIZED_COORDS_FALSE |
                                    CLK_ADDRESS_CLAMP |
                                    CLK_FILTER_LINEAR;
 
 #define PI 3.1415926535897932384626433832795028841971693993751058209749445923078164062f
 
+/*
+ * Number of slices of a sinogram stack that one work item reconstructs. The
+ * detector position is computed once per projection for all of them.
+ */
+#define SLICES_PER_ITEM 4
+
+/*
+ * Pixels farther than mask_radius from the rotation axis are not seen in all
+ * projections. They are set to zero without being reconstructed unless
+ * mask_radius is negative.
+ */
+#define OUTSIDE_MASK(bx, by, mask_radius) \
+    ((mask_radius) >= 0.0f && (bx) * (bx) + (by) * (by) > (mask_radius) * (mask_radius))
+
 __kernel void
 backproject_nearest (global float *sinogram,
                      global float *slice,
@@ -30,21 +45,48 @@ backproject_nearest (global float *sinogram,
                      constant float *cos_lut,
                      const unsigned int offset,
                      const unsigned n_projections,
-                     const float axis_pos)
+                     const float axis_pos,
+                     const unsigned int n_slices,
+                     const int roi_x,
+                     const int roi_y,
+                     const int sino_width,
+                     const float mask_radius,
+                     const int accumulate)
 {
     const int idx = get_global_id(0);
     const int idy = get_global_id(1);
     const int width = get_global_size(0);
-    const float bx = idx - axis_pos;
-    const float by = idy - axis_pos;
-    float sum = 0.0;
+    const int height = get_global_size(1);
+    const int first = get_global_id(2) * SLICES_PER_ITEM;
+    const int sino_size = n_projections * sino_width;
+    const float bx = idx + roi_x - axis_pos;
+    const float by = idy + roi_y - axis_pos;
+    float sum[SLICES_PER_ITEM];
 
-    for(int proj = 0; proj < n_projections; proj++) {
+    for (int i = 0; i < SLICES_PER_ITEM; i++)
+        sum[i] = 0.0f;
+
+    for(int proj = 0; proj < n_projections && !OUTSIDE_MASK (bx, by, mask_radius); proj++) {
         float h = axis_pos + bx * cos_lut[offset + proj] + by * sin_lut[offset + proj];
-        sum += sinogram[(int)(proj * width + h)];
+        const int row = proj * sino_width;
+        const int index = (int)(row + h);
+
+        /* Samples off the detector count as zero like in the cpu mode */
+        if (index < row || index >= row + sino_width)
+            continue;
+
+        for (int i = 0; i < SLICES_PER_ITEM; i++) {
+            if (first + i < n_slices)
+                sum[i] += sinogram[(first + i) * sino_size + index];
+        }
     }
 
-    slice[idy * width + idx] = sum * 4.0 * PI;
+    for (int i = 0; i < SLICES_PER_ITEM; i++) {
+        if (first + i < n_slices) {
+            const int index = ((first + i) * height + idy) * width + idx;
+            slice[index] = (accumulate ? slice[index] : 0.0f) + sum[i] * 4.0 * PI;
+        }
+    }
 }
 
 __kernel void
@@ -54,16 +96,20 @@ backproject_tex (read_only image2d_t sinogram,
                  constant float *cos_lut,
                  const unsigned int offset,
                  const unsigned int n_projections,
-                 const float axis_pos)
+                 const float axis_pos,
+                 const int roi_x,
+                 const int roi_y,
+                 const float mask_radius,
+                 const int accumulate)
 {
     const int idx = get_global_id(0);
     const int idy = get_global_id(1);
     const int width = get_global_size(0);
-    const float bx = idx - axis_pos;
-    const float by = idy - axis_pos;
+    const float bx = idx + roi_x - axis_pos;
+    const float by = idy + roi_y - axis_pos;
     float sum = 0.0f;
 
-    for(int proj = 0; proj < n_projections; proj++) {
+    for(int proj = 0; proj < n_projections && !OUTSIDE_MASK (bx, by, mask_radius); proj++) {
         /* mad() instructions have a performance impact of about 1% on GTX 580 */
         /* float h = mad (by, sin_lut[proj], mad(bx, cos_lut[proj], axis_pos)); */
 
@@ -72,6 +118,201 @@ backproject_tex (read_only image2d_t sinogram,
         sum += (isnan (val) ? 0.0 : val);
     }
 
-    slice[idy * width + idx] = sum * 4.0 * PI;
+    slice[idy * width + idx] = (accumulate ? slice[idy * width + idx] : 0.0f) + sum * 4.0 * PI;
+}
+
+/*
+ * Store a float sinogram in an image with a narrower channel type, e.g. half
+ * floats, which is converted by the image write.
+ */
+__kernel void
+store_sinogram_image (global float *sinogram,
+                      write_only image2d_t image)
+{
+    const int idx = get_global_id(0);
+    const int idy = get_global_id(1);
+
+    write_imagef (image, (int2)(idx, idy), (float4)(sinogram[idy * get_global_size(0) + idx], 0.0f, 0.0f, 0.0f));
+}
+
+__kernel void
+backproject_tex_stack (read_only image3d_t sinograms,
+                       global float *slices,
+                       constant float *sin_lut,
+                       constant float *cos_lut,
+                       const unsigned int offset,
+                       const unsigned int n_projections,
+                       const float axis_pos,
+                       const unsigned int n_slices,
+                       const int roi_x,
+                       const int roi_y,
+                       const float mask_radius,
+                       const int accumulate)
+{
+    const int idx = get_global_id(0);
+    const int idy = get_global_id(1);
+    const int width = get_global_size(0);
+    const int height = get_global_size(1);
+    const int first = get_global_id(2) * SLICES_PER_ITEM;
+    const float bx = idx + roi_x - axis_pos;
+    const float by = idy + roi_y - axis_pos;
+    float sum[SLICES_PER_ITEM];
+
+    for (int i = 0; i < SLICES_PER_ITEM; i++)
+        sum[i] = 0.0f;
+
+    for(int proj = 0; proj < n_projections && !OUTSIDE_MASK (bx, by, mask_radius); proj++) {
+        float h = by * sin_lut[offset + proj] + bx * cos_lut[offset + proj] + axis_pos;
+
+        for (int i = 0; i < SLICES_PER_ITEM; i++) {
+            if (first + i < n_slices) {
+                /* Sample at the center of the slice to not blend neighbouring sinograms */
+                float val = read_imagef (sinograms, volumeSampler, (float4)(h, proj, first + i + 0.5f, 0.0f)).x;
+                sum[i] += (isnan (val) ? 0.0 : val);
+            }
+        }
+    }
+
+    for (int i = 0; i < SLICES_PER_ITEM; i++) {
+        if (first + i < n_slices) {
+            const int index = ((first + i) * height + idy) * width + idx;
+            slices[index] = (accumulate ? slices[index] : 0.0f) + sum[i] * 4.0 * PI;
+        }
+    }
 }
 
+/*
+ * Each work group reconstructs a tile of TILE_SIZE * PIXELS_X by TILE_SIZE *
+ * PIXELS_Y pixels. For CHUNK projections at a time, the LUT entries and the
+ * part of each sinogram row that the tile projects onto are staged in local
+ * memory, from which every work item interpolates its pixels. These are
+ * spread with a stride of TILE_SIZE, so that neighbouring work items access
+ * neighbouring samples. Each group handles TILED_SLICES slices of a
+ * sinogram stack, sharing the interpolation weights among them. Tiles that
+ * lie completely outside of the mask skip the reconstruction.
+ */
+#define TILE_SIZE       16
+#define PIXELS_X        2
+#define PIXELS_Y        2
+#define CHUNK           32
+#define SEGMENT         64
+#define TILED_SLICES    2
+
+kernel void
+backproject_tiled (global float *sinogram,
+                   global float *slice,
+                   constant float *sin_lut,
+                   constant float *cos_lut,
+                   const unsigned int offset,
+                   const unsigned int n_projections,
+                   const float axis_pos,
+                   const int width,
+                   const unsigned int n_slices,
+                   const int roi_x,
+                   const int roi_y,
+                   const int out_width,
+                   const int out_height,
+                   const float mask_radius,
+                   const int accumulate)
+{
+    local float samples[TILED_SLICES][CHUNK][SEGMENT];
+    local float l_sin[CHUNK];
+    local float l_cos[CHUNK];
+    local int l_start[CHUNK];
+
+    const int lx = get_local_id (0);
+    const int ly = get_local_id (1);
+    const int lid = ly * TILE_SIZE + lx;
+    const int tile_x = get_group_id (0) * TILE_SIZE * PIXELS_X;
+    const int tile_y = get_group_id (1) * TILE_SIZE * PIXELS_Y;
+    const int first = get_group_id (2) * TILED_SLICES;
+    const int sino_size = n_projections * width;
+    const float tile_bx = tile_x + roi_x - axis_pos;
+    const float tile_by = tile_y + roi_y - axis_pos;
+    const float tile_width = TILE_SIZE * PIXELS_X - 1;
+    const float tile_height = TILE_SIZE * PIXELS_Y - 1;
+    const float closest_bx = clamp (0.0f, tile_bx, tile_bx + tile_width);
+    const float closest_by = clamp (0.0f, tile_by, tile_by + tile_height);
+    const int n_tile_projections = OUTSIDE_MASK (closest_bx, closest_by, mask_radius) ? 0 : n_projections;
+    float sum[TILED_SLICES][PIXELS_Y][PIXELS_X];
+
+    for (int sl = 0; sl < TILED_SLICES; sl++)
+        for (int py = 0; py < PIXELS_Y; py++)
+            for (int px = 0; px < PIXELS_X; px++)
+                sum[sl][py][px] = 0.0f;
+
+    for (int chunk = 0; chunk < n_tile_projections; chunk += CHUNK) {
+        const int n_chunk = min (CHUNK, n_tile_projections - chunk);
+
+        if (lid < n_chunk) {
+            const float s = sin_lut[offset + chunk + lid];
+            const float c = cos_lut[offset + chunk + lid];
+
+            /* Smallest detector position of the four tile corners */
+            const float h = tile_bx * c + tile_by * s +
+                            min (0.0f, tile_width * c) + min (0.0f, tile_height * s) + axis_pos;
+
+            l_sin[lid] = s;
+            l_cos[lid] = c;
+            l_start[lid] = (int) floor (h - 0.5f);
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (int i = lid; i < TILED_SLICES * n_chunk * SEGMENT; i += TILE_SIZE * TILE_SIZE) {
+            const int sl = i / (n_chunk * SEGMENT);
+            const int proj = (i / SEGMENT) % n_chunk;
+            const int x = l_start[proj] + i % SEGMENT;
+            float val = 0.0f;
+
+            if (x >= 0 && x < width && first + sl < n_slices)
+                val = sinogram[(first + sl) * sino_size + (chunk + proj) * width + x];
+
+            samples[sl][proj][i % SEGMENT] = isnan (val) ? 0.0f : val;
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (int proj = 0; proj < n_chunk; proj++) {
+            const float s = l_sin[proj];
+            const float c = l_cos[proj];
+            const float base = axis_pos - 0.5f - l_start[proj];
+
+            for (int py = 0; py < PIXELS_Y; py++) {
+                const float by = tile_by + py * TILE_SIZE + ly;
+
+                for (int px = 0; px < PIXELS_X; px++) {
+                    /* Same linear interpolation as the texture sampler */
+                    const float bx = tile_bx + px * TILE_SIZE + lx;
+                    const float h = bx * c + by * s + base;
+                    const int i = clamp ((int) floor (h), 0, SEGMENT - 2);
+                    const float w = h - i;
+
+                    for (int sl = 0; sl < TILED_SLICES; sl++)
+                        sum[sl][py][px] += mix (samples[sl][proj][i], samples[sl][proj][i + 1], w);
+                }
+            }
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int sl = 0; sl < TILED_SLICES && first + sl < n_slices; sl++) {
+        for (int py = 0; py < PIXELS_Y; py++) {
+            const int y = tile_y + py * TILE_SIZE + ly;
+            const float by = tile_by + py * TILE_SIZE + ly;
+
+            for (int px = 0; px < PIXELS_X; px++) {
+                const int x = tile_x + px * TILE_SIZE + lx;
+                const float bx = tile_bx + px * TILE_SIZE + lx;
+
+                if (x < out_width && y < out_height) {
+                    const int index = ((first + sl) * out_height + y) * out_width + x;
+                    const float value = OUTSIDE_MASK (bx, by, mask_radius) ? 0.0f : sum[sl][py][px] * 4.0f * PI;
+
+                    slice[index] = (accumulate ? slice[index] : 0.0f) + value;
+                }
+            }
+        }
+    }
+}
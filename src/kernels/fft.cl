@@ -53,6 +53,48 @@ fft_pack (__global float *in,
         out[idy*width + idx] = in[idy*dpitch + 2*idx] * scale;
 }
 
+/* Rows 2y and 2y+1 become real and imaginary part of complex row y */
+__kernel void
+fft_spread_pairs (__global float *out,
+                  __global float *in,
+                  const int width,
+                  const int height)
+{
+    const int idx = get_global_id(0);
+    const int idy = get_global_id(1);
+    const int dpitch = get_global_size(0)*2;
+    const int row = 2*idy;
+
+    if (idx < width) {
+        out[idy*dpitch + idx*2] = in[row*width + idx];
+        out[idy*dpitch + idx*2 + 1] = row + 1 < height ? in[(row + 1)*width + idx] : 0.0f;
+    }
+    else {
+        out[idy*dpitch + idx*2] = 0.0f;
+        out[idy*dpitch + idx*2 + 1] = 0.0f;
+    }
+}
+
+__kernel void
+fft_pack_pairs (__global float *in,
+                __global float *out,
+                const int width,
+                const int height,
+                const float scale)
+{
+    const int idx = get_global_id(0);
+    const int idy = get_global_id(1);
+    const int dpitch = get_global_size(0)*2;
+    const int row = 2*idy;
+
+    if (idx < width) {
+        out[row*width + idx] = in[idy*dpitch + 2*idx] * scale;
+
+        if (row + 1 < height)
+            out[(row + 1)*width + idx] = in[idy*dpitch + 2*idx + 1] * scale;
+    }
+}
+
 __kernel void
 fft_normalize (__global float *data)
 {
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include "ufo-autotune.h"
+
+/*
+ * Local work sizes are tuned once per kernel, device and global work size by
+ * timing a few candidates with the actual kernel arguments. Results are kept
+ * in a key file in the user cache directory, the device name forming the
+ * group and the kernel and global size the key. A stored size of 0 means
+ * that the driver choice was fastest.
+ *
+ * Because candidates are launched several times, only kernels whose result
+ * does not depend on previous launches with the same arguments may be tuned.
+ */
+
+#define N_REPETITIONS 3
+
+static GMutex cache_lock;
+static GKeyFile *cache = NULL;
+static gchar *cache_filename = NULL;
+
+static const gsize candidates_1d[][1] = {
+    { 32 }, { 64 }, { 128 }, { 256 },
+};
+
+static const gsize candidates_2d[][2] = {
+    { 8, 8 }, { 16, 8 }, { 16, 16 }, { 32, 4 }, { 32, 8 }, { 64, 4 },
+};
+
+static void
+load_cache (void)
+{
+    if (cache != NULL)
+        return;
+
+    cache = g_key_file_new ();
+    cache_filename = g_build_filename (g_get_user_cache_dir (), "ufo", "work-groups", NULL);
+
+    /* A missing or broken cache is just rebuilt */
+    g_key_file_load_from_file (cache, cache_filename, G_KEY_FILE_NONE, NULL);
+}
+
+/*
+ * Every plugin that tunes kernels has its own copy of this file and thus its
+ * own cache. The entry is merged into the current file contents under an
+ * exclusive lock, so that neither other plugins nor other processes lose
+ * their entries. flock() is used because, unlike fcntl() locks, it also
+ * excludes other open files of the same process.
+ */
+static void
+store_in_cache (const gchar *group, const gchar *key, gint *sizes, gsize n_sizes)
+{
+    GError *error = NULL;
+    GKeyFile *merged;
+    gchar *dirname;
+    gchar *lock_filename;
+    gchar *data;
+    gsize length;
+    int fd;
+
+    g_key_file_set_integer_list (cache, group, key, sizes, n_sizes);
+    dirname = g_path_get_dirname (cache_filename);
+    lock_filename = g_strconcat (cache_filename, ".lock", NULL);
+
+    if (g_mkdir_with_parents (dirname, 0755) != 0 ||
+        (fd = open (lock_filename, O_RDWR | O_CREAT, 0644)) < 0) {
+        g_warning ("Could not store work group sizes in `%s'", cache_filename);
+        g_free (lock_filename);
+        g_free (dirname);
+        return;
+    }
+
+    if (flock (fd, LOCK_EX) == 0) {
+        merged = g_key_file_new ();
+        g_key_file_load_from_file (merged, cache_filename, G_KEY_FILE_NONE, NULL);
+        g_key_file_set_integer_list (merged, group, key, sizes, n_sizes);
+
+        data = g_key_file_to_data (merged, &length, NULL);
+        g_file_set_contents (cache_filename, data, (gssize) length, &error);
+        g_free (data);
+
+        /* Keep the entries of the others for later lookups */
+        g_key_file_free (cache);
+        cache = merged;
+    }
+
+    if (error != NULL) {
+        g_warning ("Could not store work group sizes: %s", error->message);
+        g_error_free (error);
+    }
+
+    /* Closing releases the lock */
+    close (fd);
+    g_free (lock_filename);
+    g_free (dirname);
+}
+
+static gchar *
+get_device_group (cl_device_id device)
+{
+    gchar name[256];
+    gchar version[256];
+    gchar *group;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, CL_DEVICE_NAME, sizeof (name), name, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, CL_DRIVER_VERSION, sizeof (version), version, NULL));
+
+    /* Brackets would end the group name */
+    group = g_strdup_printf ("%s %s", name, version);
+    return g_strcanon (group, G_CSET_a_2_z G_CSET_A_2_Z G_CSET_DIGITS " ._-()", '_');
+}
+
+static gchar *
+get_kernel_key (cl_kernel kernel, guint n_dims, const gsize *global_work_size)
+{
+    gchar name[256];
+    GString *key;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetKernelInfo (kernel, CL_KERNEL_FUNCTION_NAME, sizeof (name), name, NULL));
+    key = g_string_new (name);
+
+    for (guint i = 0; i < n_dims; i++)
+        g_string_append_printf (key, "%c%" G_GSIZE_FORMAT, i == 0 ? '-' : 'x', global_work_size[i]);
+
+    return g_string_free (key, FALSE);
+}
+
+static gdouble
+time_launch (cl_command_queue cmd_queue,
+             cl_kernel kernel,
+             guint n_dims,
+             const gsize *global_work_size,
+             const gsize *local_work_size)
+{
+    GTimer *timer;
+    gdouble best = G_MAXDOUBLE;
+
+    timer = g_timer_new ();
+
+    for (guint i = 0; i < N_REPETITIONS; i++) {
+        cl_int errcode;
+
+        g_timer_start (timer);
+        errcode = clEnqueueNDRangeKernel (cmd_queue, kernel, n_dims, NULL,
+                                          global_work_size, local_work_size, 0, NULL, NULL);
+
+        /* Candidates that exceed resources of the kernel are simply not taken */
+        if (errcode != CL_SUCCESS)
+            break;
+
+        UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+        best = MIN (best, g_timer_elapsed (timer, NULL));
+    }
+
+    g_timer_destroy (timer);
+    return best;
+}
+
+static gboolean
+fits (const gsize *candidate, guint n_dims, const gsize *global_work_size, gsize max_size)
+{
+    gsize size = 1;
+
+    for (guint i = 0; i < n_dims; i++) {
+        if (candidate[i] == 0 || global_work_size[i] % candidate[i] != 0)
+            return FALSE;
+
+        size *= candidate[i];
+    }
+
+    return size <= max_size;
+}
+
+static void
+tune (cl_command_queue cmd_queue,
+      cl_device_id device,
+      cl_kernel kernel,
+      guint n_dims,
+      const gsize *global_work_size,
+      gint *best)
+{
+    gsize max_size;
+    gsize candidate[3];
+    gdouble best_time;
+    guint n_candidates;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetKernelWorkGroupInfo (kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                                                         sizeof (gsize), &max_size, NULL));
+
+    /* The first launch also pays for warming up, so it is not measured */
+    time_launch (cmd_queue, kernel, n_dims, global_work_size, NULL);
+    best_time = time_launch (cmd_queue, kernel, n_dims, global_work_size, NULL);
+
+    for (guint i = 0; i < n_dims; i++)
+        best[i] = 0;
+
+    n_candidates = n_dims == 1 ? G_N_ELEMENTS (candidates_1d) : G_N_ELEMENTS (candidates_2d);
+
+    for (guint c = 0; c < n_candidates; c++) {
+        gdouble elapsed;
+
+        /* Further dimensions are not split */
+        for (guint i = 0; i < n_dims; i++) {
+            if (n_dims == 1)
+                candidate[i] = candidates_1d[c][i];
+            else
+                candidate[i] = i < 2 ? candidates_2d[c][i] : 1;
+        }
+
+        if (!fits (candidate, n_dims, global_work_size, max_size))
+            continue;
+
+        elapsed = time_launch (cmd_queue, kernel, n_dims, global_work_size, candidate);
+
+        if (elapsed < best_time) {
+            best_time = elapsed;
+
+            for (guint i = 0; i < n_dims; i++)
+                best[i] = (gint) candidate[i];
+        }
+    }
+}
+
+/**
+ * ufo_autotune_get_local_size:
+ * @cmd_queue: Command queue of the device
+ * @kernel: Kernel with all arguments set
+ * @n_dims: Number of work dimensions
+ * @global_work_size: Global work size
+ * @local_work_size: Location for @n_dims local sizes
+ *
+ * Look up the fastest local work size, tuning it on first use.
+ *
+ * Returns: %FALSE if the driver should choose the local work size.
+ */
+gboolean
+ufo_autotune_get_local_size (cl_command_queue cmd_queue,
+                             cl_kernel kernel,
+                             guint n_dims,
+                             const gsize *global_work_size,
+                             gsize *local_work_size)
+{
+    cl_device_id device;
+    gchar *group;
+    gchar *key;
+    gint *sizes;
+    gsize n_sizes = 0;
+    gint best[3];
+
+    g_return_val_if_fail (n_dims >= 1 && n_dims <= 3, FALSE);
+
+    UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (cmd_queue, CL_QUEUE_DEVICE,
+                                                      sizeof (cl_device_id), &device, NULL));
+    group = get_device_group (device);
+    key = get_kernel_key (kernel, n_dims, global_work_size);
+
+    g_mutex_lock (&cache_lock);
+    load_cache ();
+    sizes = g_key_file_get_integer_list (cache, group, key, &n_sizes, NULL);
+
+    if (sizes == NULL || n_sizes != n_dims) {
+        tune (cmd_queue, device, kernel, n_dims, global_work_size, best);
+        store_in_cache (group, key, best, n_dims);
+    }
+    else {
+        memcpy (best, sizes, n_dims * sizeof (gint));
+    }
+
+    g_mutex_unlock (&cache_lock);
+
+    for (guint i = 0; i < n_dims; i++)
+        local_work_size[i] = (gsize) best[i];
+
+    g_free (sizes);
+    g_free (group);
+    g_free (key);
+    return best[0] > 0;
+}
+
+/**
+ * ufo_autotune_enqueue:
+ * @cmd_queue: Command queue of the device
+ * @kernel: Kernel with all arguments set
+ * @n_dims: Number of work dimensions
+ * @global_work_size: Global work size
+ * @event: (allow-none): Location for the event of the launch
+ *
+ * Launch @kernel with the tuned local work size.
+ */
+void
+ufo_autotune_enqueue (cl_command_queue cmd_queue,
+                      cl_kernel kernel,
+                      guint n_dims,
+                      const gsize *global_work_size,
+                      cl_event *event)
+{
+    gsize local_work_size[3];
+    gboolean tuned;
+
+    tuned = ufo_autotune_get_local_size (cmd_queue, kernel, n_dims, global_work_size, local_work_size);
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue, kernel, n_dims, NULL, global_work_size,
+                                                       tuned ? local_work_size : NULL, 0, NULL, event));
+}
+
+/**
+ * ufo_autotune_call:
+ * @profiler: Profiler of the calling task
+ * @cmd_queue: Command queue of the device
+ * @kernel: Kernel with all arguments set
+ * @n_dims: Number of work dimensions
+ * @global_work_size: Global work size
+ *
+ * Like ufo_profiler_call() with the tuned local work size.
+ */
+void
+ufo_autotune_call (UfoProfiler *profiler,
+                   cl_command_queue cmd_queue,
+                   cl_kernel kernel,
+                   guint n_dims,
+                   const gsize *global_work_size)
+{
+    gsize local_work_size[3];
+    gboolean tuned;
+
+    tuned = ufo_autotune_get_local_size (cmd_queue, kernel, n_dims, global_work_size, local_work_size);
+    ufo_profiler_call (profiler, cmd_queue, kernel, n_dims, global_work_size,
+                       tuned ? local_work_size : NULL);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __UFO_AUTOTUNE_H
+#define __UFO_AUTOTUNE_H
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <ufo/ufo.h>
+
+G_BEGIN_DECLS
+
+gboolean ufo_autotune_get_local_size    (cl_command_queue    cmd_queue,
+                                         cl_kernel           kernel,
+                                         guint               n_dims,
+                                         const gsize        *global_work_size,
+                                         gsize              *local_work_size);
+void     ufo_autotune_enqueue           (cl_command_queue    cmd_queue,
+                                         cl_kernel           kernel,
+                                         guint               n_dims,
+                                         const gsize        *global_work_size,
+                                         cl_event           *event);
+void     ufo_autotune_call              (UfoProfiler        *profiler,
+                                         cl_command_queue    cmd_queue,
+                                         cl_kernel           kernel,
+                                         guint               n_dims,
+                                         const gsize        *global_work_size);
+
+G_END_DECLS
+
+#endif
@@ -24,22 +24,62 @@
 #endif
 
 #include <math.h>
+#include <string.h>
 #include "ufo-backproject-task.h"
+#include "ufo-autotune.h"
 
+/* Must match the work distribution of the kernels in backproject.cl */
+#define TILE_SIZE       16
+#define PIXELS_X        2
+#define PIXELS_Y        2
+#define TILED_SLICES    2
+#define SLICES_PER_ITEM 4
+
+/* Rows and projections processed together on the CPU to keep them in cache */
+#define CPU_ROWS        8
+#define CPU_PROJECTIONS 32
+
+/* Number of LUTs that are kept for later runs after their last user is gone */
+#define LUT_CACHE_UNUSED 8
 
 typedef enum {
     MODE_NEAREST,
-    MODE_TEXTURE
+    MODE_TEXTURE,
+    MODE_TILED,
+    MODE_CPU
 } Mode;
 
+/*
+ * Sine and cosine LUTs are shared by all tasks with the same geometry on the
+ * same context, i.e. by all copies of the task made for multiple GPUs.
+ */
+typedef struct {
+    cl_context context;
+    guint n_entries;
+    gdouble angle_step;
+    gdouble angle_offset;
+    gfloat *host_sin;
+    gfloat *host_cos;
+    cl_mem sin_mem;
+    cl_mem cos_mem;
+    guint ref_count;
+} LutEntry;
+
+static GList *lut_cache = NULL;
+static GMutex lut_cache_lock;
+
 struct _UfoBackprojectTaskPrivate {
     cl_context context;
     cl_kernel nearest_kernel;
     cl_kernel texture_kernel;
-    cl_mem sin_lut;
-    cl_mem cos_lut;
-    gfloat *host_sin_lut;
-    gfloat *host_cos_lut;
+    cl_kernel texture_stack_kernel;
+    cl_kernel tiled_kernel;
+    cl_kernel store_kernel;
+    cl_mem half_image;
+    gsize half_image_dims[2];
+    gboolean half_supported;
+    gboolean half_precision;
+    LutEntry *lut;
     gdouble axis_pos;
     gdouble angle_step;
     gdouble angle_offset;
@@ -48,6 +88,16 @@ struct _UfoBackprojectTaskPrivate {
     guint offset;
     guint burst_projections;
     guint n_projections;
+    guint roi_x;
+    guint roi_y;
+    guint roi_width;
+    guint roi_height;
+    gboolean circular_mask;
+    gboolean accumulate;
+    guint n_accumulated;
+    cl_mem accum_mem;
+    gsize accum_size;
+    gfloat *host_accum;
     Mode mode;
 };
 
@@ -67,6 +117,13 @@ enum {
     PROP_ANGLE_STEP,
     PROP_ANGLE_OFFSET,
     PROP_MODE,
+    PROP_ROI_X,
+    PROP_ROI_Y,
+    PROP_ROI_WIDTH,
+    PROP_ROI_HEIGHT,
+    PROP_CIRCULAR_MASK,
+    PROP_HALF_PRECISION,
+    PROP_ACCUMULATE,
     N_PROPERTIES
 };
 
@@ -78,6 +135,246 @@ ufo_backproject_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_BACKPROJECT_TASK, NULL));
 }
 
+static gboolean
+supports_half_images (cl_context context)
+{
+    cl_image_format *formats;
+    cl_uint n_formats;
+    gboolean found = FALSE;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetSupportedImageFormats (context, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+                                                           0, NULL, &n_formats));
+    formats = g_new0 (cl_image_format, n_formats);
+    UFO_RESOURCES_CHECK_CLERR (clGetSupportedImageFormats (context, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+                                                           n_formats, formats, NULL));
+
+    for (guint i = 0; i < n_formats && !found; i++)
+        found = formats[i].image_channel_order == CL_R && formats[i].image_channel_data_type == CL_HALF_FLOAT;
+
+    g_free (formats);
+    return found;
+}
+
+/*
+ * Convert the sinogram into a half float image, which halves the texture
+ * footprint while the kernel still accumulates in float.
+ */
+static cl_mem
+get_half_image (UfoBackprojectTaskPrivate *priv, UfoBuffer *input, cl_command_queue cmd_queue)
+{
+    UfoRequisition in_req;
+    cl_mem in_mem;
+
+    ufo_buffer_get_requisition (input, &in_req);
+
+    if (priv->half_image != NULL &&
+        (priv->half_image_dims[0] != in_req.dims[0] || priv->half_image_dims[1] != in_req.dims[1])) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->half_image));
+        priv->half_image = NULL;
+    }
+
+    if (priv->half_image == NULL) {
+        cl_image_format format;
+        cl_int errcode;
+
+        format.image_channel_order = CL_R;
+        format.image_channel_data_type = CL_HALF_FLOAT;
+
+        priv->half_image = clCreateImage2D (priv->context, CL_MEM_READ_WRITE, &format,
+                                            in_req.dims[0], in_req.dims[1], 0, NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+        priv->half_image_dims[0] = in_req.dims[0];
+        priv->half_image_dims[1] = in_req.dims[1];
+    }
+
+    in_mem = ufo_buffer_get_device_array (input, cmd_queue);
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->store_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->store_kernel, 1, sizeof (cl_mem), &priv->half_image));
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue, priv->store_kernel,
+                                                       2, NULL, in_req.dims, NULL,
+                                                       0, NULL, NULL));
+
+    return priv->half_image;
+}
+
+static gfloat
+get_axis_pos (UfoBackprojectTaskPrivate *priv, gsize sino_width)
+{
+    /* Guess axis position if they are not provided by the user. */
+    if (priv->axis_pos <= 0.0)
+        return ((gfloat) sino_width) / 2.0f;
+
+    return (gfloat) priv->axis_pos;
+}
+
+static gfloat
+get_mask_radius (UfoBackprojectTaskPrivate *priv, gfloat axis_pos, gsize sino_width)
+{
+    /* Only pixels within the smaller distance to a detector edge are seen in all projections */
+    if (priv->circular_mask)
+        return MIN (axis_pos, sino_width - axis_pos);
+
+    return -1.0f;
+}
+
+/*
+ * Same interpolation as backproject_nearest. Threads work on bands of
+ * CPU_ROWS rows, which accumulate CPU_PROJECTIONS sinogram rows at a time
+ * so that both stay in cache, and the pixels of a row are vectorized.
+ */
+static void
+backproject_cpu (UfoBackprojectTaskPrivate *priv,
+                 const gfloat *sinogram,
+                 gfloat *slice,
+                 guint lut_offset,
+                 gint sino_width,
+                 gint width,
+                 gint height,
+                 gfloat axis_pos,
+                 gfloat mask_radius)
+{
+    const guint n_projections = priv->burst_projections;
+    const gfloat *sin_lut = priv->lut->host_sin + lut_offset;
+    const gfloat *cos_lut = priv->lut->host_cos + lut_offset;
+    const gfloat scale = (gfloat) (4.0 * G_PI);
+
+    memset (slice, 0, sizeof (gfloat) * width * height);
+
+#pragma omp parallel for schedule(dynamic)
+    for (gint band = 0; band < height; band += CPU_ROWS) {
+        const gint last_row = MIN (band + CPU_ROWS, height);
+
+        for (guint block = 0; block < n_projections; block += CPU_PROJECTIONS) {
+            const guint last_projection = MIN (block + CPU_PROJECTIONS, n_projections);
+
+            for (gint y = band; y < last_row; y++) {
+                const gfloat by = y + priv->roi_y - axis_pos;
+                gfloat *row = slice + y * width;
+                gint x_start = 0;
+                gint x_end = width;
+
+                if (mask_radius >= 0.0f) {
+                    gfloat half;
+
+                    if (by * by > mask_radius * mask_radius)
+                        continue;
+
+                    half = sqrtf (mask_radius * mask_radius - by * by);
+                    x_start = MAX (0, (gint) ceilf (axis_pos - half - priv->roi_x));
+                    x_end = MIN (width, (gint) floorf (axis_pos + half - priv->roi_x) + 1);
+                }
+
+                for (guint proj = block; proj < last_projection; proj++) {
+                    const gint row_offset = (gint) proj * sino_width;
+                    const gfloat s = sin_lut[proj];
+                    const gfloat c = cos_lut[proj];
+
+                    /* Computed in the same order as on the GPU to sample the same detector pixels */
+#pragma omp simd
+                    for (gint x = x_start; x < x_end; x++) {
+                        const gfloat bx = x + priv->roi_x - axis_pos;
+                        const gfloat h = axis_pos + bx * c + by * s;
+                        const gint index = (gint) (row_offset + h);
+
+                        row[x] += (index >= row_offset && index < row_offset + sino_width) ? sinogram[index] : 0.0f;
+                    }
+                }
+            }
+        }
+
+        for (gint y = band; y < last_row; y++) {
+            for (gint x = 0; x < width; x++)
+                slice[y * width + x] *= scale;
+        }
+    }
+}
+
+/*
+ * In accumulate mode, a burst continues where the previous one stopped. After
+ * all projections, the next burst starts a new reconstruction.
+ */
+static guint
+start_burst (UfoBackprojectTaskPrivate *priv, gboolean *accumulate)
+{
+    guint first;
+
+    *accumulate = priv->accumulate && priv->n_accumulated > 0;
+    first = priv->accumulate ? priv->offset + priv->n_accumulated : priv->offset;
+
+    /* The burst size may change between inputs, never read past the LUT */
+    if (first + priv->burst_projections > priv->n_projections) {
+        g_error ("Burst of %u projections starting at %u exceeds the total number of projections (%u)",
+                 priv->burst_projections, first, priv->n_projections);
+    }
+
+    return first;
+}
+
+static void
+finish_burst (UfoBackprojectTaskPrivate *priv)
+{
+    if (!priv->accumulate)
+        return;
+
+    priv->n_accumulated += priv->burst_projections;
+
+    if (priv->offset + priv->n_accumulated >= priv->n_projections)
+        priv->n_accumulated = 0;
+}
+
+static gboolean
+process_cpu (UfoBackprojectTaskPrivate *priv,
+             UfoBuffer *input,
+             UfoBuffer *output,
+             UfoRequisition *requisition)
+{
+    UfoRequisition in_req;
+    gfloat *sinograms;
+    gfloat *slices;
+    gfloat axis_pos;
+    gfloat mask_radius;
+    gsize n_slices;
+    gsize sino_size;
+    gsize slice_size;
+    guint lut_offset;
+    gboolean accumulate;
+
+    ufo_buffer_get_requisition (input, &in_req);
+    sinograms = ufo_buffer_get_host_array (input, NULL);
+    slices = ufo_buffer_get_host_array (output, NULL);
+
+    axis_pos = get_axis_pos (priv, in_req.dims[0]);
+    mask_radius = get_mask_radius (priv, axis_pos, in_req.dims[0]);
+    n_slices = requisition->n_dims == 3 ? requisition->dims[2] : 1;
+    sino_size = in_req.dims[0] * in_req.dims[1];
+    slice_size = requisition->dims[0] * requisition->dims[1];
+    lut_offset = start_burst (priv, &accumulate);
+
+    for (gsize i = 0; i < n_slices; i++) {
+        backproject_cpu (priv, sinograms + i * sino_size, slices + i * slice_size, lut_offset,
+                         (gint) in_req.dims[0], (gint) requisition->dims[0], (gint) requisition->dims[1],
+                         axis_pos, mask_radius);
+    }
+
+    if (priv->accumulate) {
+        gsize n_pixels = n_slices * slice_size;
+
+        if (!accumulate) {
+            priv->host_accum = g_realloc (priv->host_accum, n_pixels * sizeof (gfloat));
+            memcpy (priv->host_accum, slices, n_pixels * sizeof (gfloat));
+        }
+        else {
+            for (gsize i = 0; i < n_pixels; i++)
+                priv->host_accum[i] += slices[i];
+
+            memcpy (slices, priv->host_accum, n_pixels * sizeof (gfloat));
+        }
+    }
+
+    finish_burst (priv);
+    return TRUE;
+}
+
 static gboolean
 ufo_backproject_task_process (UfoTask *task,
                               UfoBuffer **inputs,
@@ -87,43 +384,152 @@ ufo_backproject_task_process (UfoTask *task,
     UfoBackprojectTaskPrivate *priv;
     UfoGpuNode *node;
     UfoProfiler *profiler;
+    UfoRequisition in_req;
     cl_command_queue cmd_queue;
     cl_mem in_mem;
     cl_mem out_mem;
     cl_kernel kernel;
     gfloat axis_pos;
+    gfloat mask_radius;
+    gint sino_width;
+    gint roi_x;
+    gint roi_y;
+    gint out_width;
+    gint out_height;
+    guint n_slices;
+    guint lut_offset;
+    gboolean accumulate;
+    cl_int accumulate_arg;
+    gsize global_work_size[3];
+    gsize local_work_size[3] = { TILE_SIZE, TILE_SIZE, 1 };
 
     priv = UFO_BACKPROJECT_TASK (task)->priv;
+
+    if (priv->mode == MODE_CPU)
+        return process_cpu (priv, inputs[0], output, requisition);
+
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
     out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+    ufo_buffer_get_requisition (inputs[0], &in_req);
 
-    if (priv->mode == MODE_TEXTURE) {
-        in_mem = ufo_buffer_get_device_image (inputs[0], cmd_queue);
+    /* A stack of sinograms is reconstructed with a single launch */
+    n_slices = requisition->n_dims == 3 ? (guint) requisition->dims[2] : 1;
+
+    if (priv->mode == MODE_TEXTURE && requisition->n_dims == 2 && priv->half_precision && priv->half_supported) {
+        in_mem = get_half_image (priv, inputs[0], cmd_queue);
         kernel = priv->texture_kernel;
     }
+    else if (priv->mode == MODE_TEXTURE) {
+        in_mem = ufo_buffer_get_device_image (inputs[0], cmd_queue);
+        kernel = requisition->n_dims == 3 ? priv->texture_stack_kernel : priv->texture_kernel;
+    }
+    else if (priv->mode == MODE_TILED) {
+        in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+        kernel = priv->tiled_kernel;
+    }
     else {
         in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
         kernel = priv->nearest_kernel;
     }
 
-    /* Guess axis position if they are not provided by the user. */
-    if (priv->axis_pos <= 0.0)
-        axis_pos = (gfloat) ((gfloat) requisition->dims[0]) / 2.0f;
-    else
-        axis_pos = priv->axis_pos;
+    axis_pos = get_axis_pos (priv, in_req.dims[0]);
+    mask_radius = get_mask_radius (priv, axis_pos, in_req.dims[0]);
+    sino_width = (gint) in_req.dims[0];
+    roi_x = (gint) priv->roi_x;
+    roi_y = (gint) priv->roi_y;
+    out_width = (gint) requisition->dims[0];
+    out_height = (gint) requisition->dims[1];
+    lut_offset = start_burst (priv, &accumulate);
+    accumulate_arg = accumulate ? 1 : 0;
+
+    /* Bursts are added to a slice that stays on the device, a copy of which is passed on */
+    if (priv->accumulate) {
+        gsize size = ufo_buffer_get_size (output);
+
+        if (priv->accum_mem != NULL && priv->accum_size != size) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->accum_mem));
+            priv->accum_mem = NULL;
+        }
+
+        if (priv->accum_mem == NULL) {
+            cl_int errcode;
+
+            priv->accum_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, size, NULL, &errcode);
+            UFO_RESOURCES_CHECK_CLERR (errcode);
+            priv->accum_size = size;
+        }
+    }
 
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &in_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &out_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &priv->sin_lut));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_mem), &priv->cos_lut));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 4, sizeof (guint),  &priv->offset));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), priv->accumulate ? &priv->accum_mem : &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &priv->lut->sin_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_mem), &priv->lut->cos_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 4, sizeof (guint),  &lut_offset));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 5, sizeof (guint),  &priv->burst_projections));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 6, sizeof (gfloat), &axis_pos));
 
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
-    ufo_profiler_call (profiler, cmd_queue, kernel, 2, requisition->dims, NULL);
 
+    if (priv->mode == MODE_TILED) {
+        /* Every work item computes PIXELS_X * PIXELS_Y pixels of TILED_SLICES slices */
+        global_work_size[0] = ((requisition->dims[0] + TILE_SIZE * PIXELS_X - 1) / (TILE_SIZE * PIXELS_X)) * TILE_SIZE;
+        global_work_size[1] = ((requisition->dims[1] + TILE_SIZE * PIXELS_Y - 1) / (TILE_SIZE * PIXELS_Y)) * TILE_SIZE;
+        global_work_size[2] = (n_slices + TILED_SLICES - 1) / TILED_SLICES;
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 7, sizeof (gint), &sino_width));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 8, sizeof (guint), &n_slices));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 9, sizeof (gint), &roi_x));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 10, sizeof (gint), &roi_y));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 11, sizeof (gint), &out_width));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 12, sizeof (gint), &out_height));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 13, sizeof (gfloat), &mask_radius));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 14, sizeof (cl_int), &accumulate_arg));
+        ufo_profiler_call (profiler, cmd_queue, kernel, 3, global_work_size, local_work_size);
+    }
+    else if (kernel == priv->texture_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 7, sizeof (gint), &roi_x));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 8, sizeof (gint), &roi_y));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 9, sizeof (gfloat), &mask_radius));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 10, sizeof (cl_int), &accumulate_arg));
+
+        /* Accumulating launches add to their output and cannot be repeated */
+        if (priv->accumulate)
+            ufo_profiler_call (profiler, cmd_queue, kernel, 2, requisition->dims, NULL);
+        else
+            ufo_autotune_call (profiler, cmd_queue, kernel, 2, requisition->dims);
+    }
+    else {
+        global_work_size[0] = requisition->dims[0];
+        global_work_size[1] = requisition->dims[1];
+        global_work_size[2] = (n_slices + SLICES_PER_ITEM - 1) / SLICES_PER_ITEM;
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 7, sizeof (guint), &n_slices));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 8, sizeof (gint), &roi_x));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 9, sizeof (gint), &roi_y));
+
+        if (kernel == priv->nearest_kernel) {
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 10, sizeof (gint), &sino_width));
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 11, sizeof (gfloat), &mask_radius));
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 12, sizeof (cl_int), &accumulate_arg));
+        }
+        else {
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 10, sizeof (gfloat), &mask_radius));
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 11, sizeof (cl_int), &accumulate_arg));
+        }
+
+        if (priv->accumulate)
+            ufo_profiler_call (profiler, cmd_queue, kernel, 3, global_work_size, NULL);
+        else
+            ufo_autotune_call (profiler, cmd_queue, kernel, 3, global_work_size);
+    }
+
+    if (priv->accumulate) {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, priv->accum_mem, out_mem,
+                                                        0, 0, priv->accum_size, 0, NULL, NULL));
+    }
+
+    finish_burst (priv);
     return TRUE;
 }
 
@@ -136,9 +542,22 @@ ufo_backproject_task_setup (UfoTask *task,
 
     priv = UFO_BACKPROJECT_TASK_GET_PRIVATE (task);
 
+    if (priv->accumulate && priv->n_projections == 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Accumulating bursts requires `num-projections'");
+        return;
+    }
+
+    /* The CPU implementation does not use OpenCL at all */
+    if (priv->mode == MODE_CPU)
+        return;
+
     priv->context = ufo_resources_get_context (resources);
     priv->nearest_kernel = ufo_resources_get_kernel (resources, "backproject.cl", "backproject_nearest", error);
     priv->texture_kernel = ufo_resources_get_kernel (resources, "backproject.cl", "backproject_tex", error);
+    priv->texture_stack_kernel = ufo_resources_get_kernel (resources, "backproject.cl", "backproject_tex_stack", error);
+    priv->tiled_kernel = ufo_resources_get_kernel (resources, "backproject.cl", "backproject_tiled", error);
+    priv->store_kernel = ufo_resources_get_kernel (resources, "backproject.cl", "store_sinogram_image", error);
 
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
 
@@ -147,24 +566,42 @@ ufo_backproject_task_setup (UfoTask *task,
 
     if (priv->texture_kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->texture_kernel));
+
+    if (priv->texture_stack_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->texture_stack_kernel));
+
+    if (priv->tiled_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->tiled_kernel));
+
+    if (priv->store_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->store_kernel));
+
+    priv->half_supported = supports_half_images (priv->context);
+
+    if (priv->half_precision && !priv->half_supported)
+        g_warning ("Device does not support half float images, using float");
 }
 
 static cl_mem
-create_lut_buffer (UfoBackprojectTaskPrivate *priv,
+create_lut_buffer (cl_context context,
                    gfloat **host_mem,
-                   gsize n_entries,
+                   LutEntry *entry,
                    double (*func)(double))
 {
     cl_int errcode;
-    gsize size = n_entries * sizeof (gfloat);
+    gsize size = entry->n_entries * sizeof (gfloat);
     cl_mem mem = NULL;
 
-    *host_mem = g_realloc (*host_mem, size);
+    *host_mem = g_malloc (size);
 
-    for (guint i = 0; i < n_entries; i++)
-        (*host_mem)[i] = (gfloat) func (priv->angle_offset + i * priv->real_angle_step);
+    for (guint i = 0; i < entry->n_entries; i++)
+        (*host_mem)[i] = (gfloat) func (entry->angle_offset + i * entry->angle_step);
 
-    mem = clCreateBuffer (priv->context,
+    /* The CPU mode has no context and only needs the host LUTs */
+    if (context == NULL)
+        return NULL;
+
+    mem = clCreateBuffer (context,
                           CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
                           size, *host_mem,
                           &errcode);
@@ -174,17 +611,86 @@ create_lut_buffer (UfoBackprojectTaskPrivate *priv,
 }
 
 static void
-release_lut_mems (UfoBackprojectTaskPrivate *priv)
+free_lut_entry (LutEntry *entry)
+{
+    if (entry->sin_mem)
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (entry->sin_mem));
+
+    if (entry->cos_mem)
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (entry->cos_mem));
+
+    if (entry->context)
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (entry->context));
+
+    g_free (entry->host_sin);
+    g_free (entry->host_cos);
+    g_free (entry);
+}
+
+static LutEntry *
+acquire_lut (cl_context context, guint n_entries, gdouble angle_step, gdouble angle_offset)
 {
-    if (priv->sin_lut) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->sin_lut));
-        priv->sin_lut = NULL;
+    LutEntry *entry = NULL;
+
+    g_mutex_lock (&lut_cache_lock);
+
+    for (GList *it = g_list_first (lut_cache); it != NULL; it = g_list_next (it)) {
+        LutEntry *candidate = (LutEntry *) it->data;
+
+        if (candidate->context == context && candidate->n_entries == n_entries &&
+            candidate->angle_step == angle_step && candidate->angle_offset == angle_offset) {
+            entry = candidate;
+            lut_cache = g_list_delete_link (lut_cache, it);
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = g_new0 (LutEntry, 1);
+        entry->context = context;
+        entry->n_entries = n_entries;
+        entry->angle_step = angle_step;
+        entry->angle_offset = angle_offset;
+        entry->sin_mem = create_lut_buffer (context, &entry->host_sin, entry, sin);
+        entry->cos_mem = create_lut_buffer (context, &entry->host_cos, entry, cos);
+
+        if (context != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clRetainContext (context));
     }
 
-    if (priv->cos_lut) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->cos_lut));
-        priv->cos_lut = NULL;
+    /* Most recently used entries are kept at the front */
+    entry->ref_count++;
+    lut_cache = g_list_prepend (lut_cache, entry);
+    g_mutex_unlock (&lut_cache_lock);
+
+    return entry;
+}
+
+static void
+release_lut (LutEntry *entry)
+{
+    guint n_unused = 0;
+    GList *it;
+
+    g_mutex_lock (&lut_cache_lock);
+    entry->ref_count--;
+
+    /* Free the least recently used entries that nobody uses anymore */
+    it = g_list_first (lut_cache);
+
+    while (it != NULL) {
+        GList *next = g_list_next (it);
+        LutEntry *candidate = (LutEntry *) it->data;
+
+        if (candidate->ref_count == 0 && ++n_unused > LUT_CACHE_UNUSED) {
+            free_lut_entry (candidate);
+            lut_cache = g_list_delete_link (lut_cache, it);
+        }
+
+        it = next;
     }
+
+    g_mutex_unlock (&lut_cache_lock);
 }
 
 static void
@@ -210,30 +716,54 @@ ufo_backproject_task_get_requisition (UfoTask *task,
                 "or equal to sinogram height (%u)", priv->n_projections, priv->burst_projections);
     }
 
-    requisition->n_dims = 2;
-    requisition->dims[0] = in_req.dims[0];
-    requisition->dims[1] = in_req.dims[0];
+    if (priv->offset + priv->burst_projections > priv->n_projections) {
+        g_error ("Projections %u to %u are beyond the total number of projections (%u)",
+                 priv->offset, priv->offset + priv->burst_projections - 1, priv->n_projections);
+    }
+
+    if (priv->accumulate && (priv->n_projections - priv->offset) % priv->burst_projections != 0) {
+        g_error ("Number of accumulated projections (%u) must be a multiple of the burst size (%u)",
+                 priv->n_projections - priv->offset, priv->burst_projections);
+    }
+
+    if (priv->roi_x >= in_req.dims[0] || priv->roi_y >= in_req.dims[0]) {
+        g_error ("Region of interest starts at (%u, %u) outside of the %u pixel wide slice",
+                 priv->roi_x, priv->roi_y, (guint) in_req.dims[0]);
+    }
+
+    /* Only the region of interest is reconstructed */
+    requisition->n_dims = in_req.n_dims == 3 ? 3 : 2;
+    requisition->dims[0] = in_req.dims[0] - priv->roi_x;
+    requisition->dims[1] = in_req.dims[0] - priv->roi_y;
+
+    if (priv->roi_width > 0)
+        requisition->dims[0] = MIN (requisition->dims[0], priv->roi_width);
+
+    if (priv->roi_height > 0)
+        requisition->dims[1] = MIN (requisition->dims[1], priv->roi_height);
+
+    if (in_req.n_dims == 3)
+        requisition->dims[2] = in_req.dims[2];
 
     if (priv->real_angle_step < 0.0) {
-        if (priv->angle_step <= 0.0)
+        if (priv->angle_step <= 0.0 && priv->accumulate)
+            priv->real_angle_step = G_PI / ((gdouble) priv->n_projections);
+        else if (priv->angle_step <= 0.0)
             priv->real_angle_step = G_PI / ((gdouble) in_req.dims[1]);
         else
             priv->real_angle_step = priv->angle_step;
     }
 
-    if (priv->luts_changed) {
-        release_lut_mems (priv);
-        priv->luts_changed = FALSE;
+    if (priv->luts_changed && priv->lut != NULL) {
+        release_lut (priv->lut);
+        priv->lut = NULL;
     }
 
-    if (priv->sin_lut == NULL) {
-        priv->sin_lut = create_lut_buffer (priv, &priv->host_sin_lut,
-                                           priv->n_projections, sin);
-    }
+    priv->luts_changed = FALSE;
 
-    if (priv->cos_lut == NULL) {
-        priv->cos_lut = create_lut_buffer (priv, &priv->host_cos_lut,
-                                           priv->n_projections, cos);
+    if (priv->lut == NULL) {
+        priv->lut = acquire_lut (priv->context, priv->n_projections,
+                                 priv->real_angle_step, priv->angle_offset);
     }
 }
 
@@ -254,14 +784,62 @@ ufo_filter_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_filter_task_get_mode (UfoTask *task)
 {
+    UfoBackprojectTaskPrivate *priv = UFO_BACKPROJECT_TASK_GET_PRIVATE (task);
+
+    if (priv->mode == MODE_CPU)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+
     return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
 }
 
+static UfoNode *
+ufo_backproject_task_copy_real (UfoNode *node,
+                                GError **error)
+{
+    UfoBackprojectTaskPrivate *orig;
+    UfoBackprojectTask *copy;
+
+    orig = UFO_BACKPROJECT_TASK (node)->priv;
+
+    /*
+     * The bursts of an accumulated reconstruction are distributed among the
+     * copies, each of which would reconstruct with the wrong angles into its
+     * own partial result.
+     */
+    if (orig->accumulate) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Accumulating backprojection cannot be copied to more than one GPU, "
+                     "disable the expansion of the scheduler");
+        return NULL;
+    }
+
+    copy = UFO_BACKPROJECT_TASK (ufo_backproject_task_new ());
+    copy->priv->n_projections = orig->n_projections;
+    copy->priv->offset = orig->offset;
+    copy->priv->axis_pos = orig->axis_pos;
+    copy->priv->angle_step = orig->angle_step;
+    copy->priv->angle_offset = orig->angle_offset;
+    copy->priv->mode = orig->mode;
+    copy->priv->roi_x = orig->roi_x;
+    copy->priv->roi_y = orig->roi_y;
+    copy->priv->roi_width = orig->roi_width;
+    copy->priv->roi_height = orig->roi_height;
+    copy->priv->circular_mask = orig->circular_mask;
+    copy->priv->half_precision = orig->half_precision;
+
+    return UFO_NODE (copy);
+}
+
 static gboolean
 ufo_backproject_task_equal_real (UfoNode *n1,
                             UfoNode *n2)
 {
     g_return_val_if_fail (UFO_IS_BACKPROJECT_TASK (n1) && UFO_IS_BACKPROJECT_TASK (n2), FALSE);
+
+    /* Accumulating tasks keep a reconstruction of their own */
+    if (UFO_BACKPROJECT_TASK (n1)->priv->accumulate || UFO_BACKPROJECT_TASK (n2)->priv->accumulate)
+        return FALSE;
+
     return UFO_BACKPROJECT_TASK (n1)->priv->texture_kernel == UFO_BACKPROJECT_TASK (n2)->priv->texture_kernel;
 }
 
@@ -272,10 +850,10 @@ ufo_backproject_task_finalize (GObject *object)
 
     priv = UFO_BACKPROJECT_TASK_GET_PRIVATE (object);
 
-    release_lut_mems (priv);
-
-    g_free (priv->host_sin_lut);
-    g_free (priv->host_cos_lut);
+    if (priv->lut != NULL) {
+        release_lut (priv->lut);
+        priv->lut = NULL;
+    }
 
     if (priv->nearest_kernel) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->nearest_kernel));
@@ -287,6 +865,33 @@ ufo_backproject_task_finalize (GObject *object)
         priv->texture_kernel = NULL;
     }
 
+    if (priv->texture_stack_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->texture_stack_kernel));
+        priv->texture_stack_kernel = NULL;
+    }
+
+    if (priv->tiled_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->tiled_kernel));
+        priv->tiled_kernel = NULL;
+    }
+
+    if (priv->store_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->store_kernel));
+        priv->store_kernel = NULL;
+    }
+
+    if (priv->half_image) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->half_image));
+        priv->half_image = NULL;
+    }
+
+    if (priv->accum_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->accum_mem));
+        priv->accum_mem = NULL;
+    }
+
+    g_free (priv->host_accum);
+
     if (priv->context) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
         priv->context = NULL;
@@ -336,6 +941,31 @@ ufo_backproject_task_set_property (GObject *object,
                 priv->mode = MODE_NEAREST;
             else if (!g_strcmp0 (g_value_get_string (value), "texture"))
                 priv->mode = MODE_TEXTURE;
+            else if (!g_strcmp0 (g_value_get_string (value), "tiled"))
+                priv->mode = MODE_TILED;
+            else if (!g_strcmp0 (g_value_get_string (value), "cpu"))
+                priv->mode = MODE_CPU;
+            break;
+        case PROP_ROI_X:
+            priv->roi_x = g_value_get_uint (value);
+            break;
+        case PROP_ROI_Y:
+            priv->roi_y = g_value_get_uint (value);
+            break;
+        case PROP_ROI_WIDTH:
+            priv->roi_width = g_value_get_uint (value);
+            break;
+        case PROP_ROI_HEIGHT:
+            priv->roi_height = g_value_get_uint (value);
+            break;
+        case PROP_CIRCULAR_MASK:
+            priv->circular_mask = g_value_get_boolean (value);
+            break;
+        case PROP_HALF_PRECISION:
+            priv->half_precision = g_value_get_boolean (value);
+            break;
+        case PROP_ACCUMULATE:
+            priv->accumulate = g_value_get_boolean (value);
             break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -375,8 +1005,35 @@ ufo_backproject_task_get_property (GObject *object,
                 case MODE_TEXTURE:
                     g_value_set_string (value, "texture");
                     break;
+                case MODE_TILED:
+                    g_value_set_string (value, "tiled");
+                    break;
+                case MODE_CPU:
+                    g_value_set_string (value, "cpu");
+                    break;
             }
             break;
+        case PROP_ROI_X:
+            g_value_set_uint (value, priv->roi_x);
+            break;
+        case PROP_ROI_Y:
+            g_value_set_uint (value, priv->roi_y);
+            break;
+        case PROP_ROI_WIDTH:
+            g_value_set_uint (value, priv->roi_width);
+            break;
+        case PROP_ROI_HEIGHT:
+            g_value_set_uint (value, priv->roi_height);
+            break;
+        case PROP_CIRCULAR_MASK:
+            g_value_set_boolean (value, priv->circular_mask);
+            break;
+        case PROP_HALF_PRECISION:
+            g_value_set_boolean (value, priv->half_precision);
+            break;
+        case PROP_ACCUMULATE:
+            g_value_set_boolean (value, priv->accumulate);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
             break;
@@ -435,13 +1092,63 @@ ufo_backproject_task_class_init (UfoBackprojectTaskClass *klass)
     properties[PROP_MODE] =
         g_param_spec_string ("mode",
                              "Backprojection mode",
-                             "Backprojection mode from: \"nearest\", \"texture\"",
+                             "Backprojection mode from: \"nearest\", \"texture\", \"tiled\", \"cpu\"",
                              "texture",
                              G_PARAM_READWRITE);
 
+    properties[PROP_ROI_X] =
+        g_param_spec_uint ("roi-x",
+                           "Horizontal coordinate of the region of interest",
+                           "Horizontal coordinate of the region of interest",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_ROI_Y] =
+        g_param_spec_uint ("roi-y",
+                           "Vertical coordinate of the region of interest",
+                           "Vertical coordinate of the region of interest",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_ROI_WIDTH] =
+        g_param_spec_uint ("roi-width",
+                           "Width of the region of interest",
+                           "Width of the region of interest, 0 to reconstruct up to the right border",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_ROI_HEIGHT] =
+        g_param_spec_uint ("roi-height",
+                           "Height of the region of interest",
+                           "Height of the region of interest, 0 to reconstruct up to the bottom border",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_CIRCULAR_MASK] =
+        g_param_spec_boolean ("circular-mask",
+                              "Skip pixels outside of the field of view",
+                              "Set pixels outside of the circular field of view to zero without reconstructing them",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_HALF_PRECISION] =
+        g_param_spec_boolean ("half-precision",
+                              "Store the sinogram texture in half precision",
+                              "Store the sinogram texture in half precision if the device supports it",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_ACCUMULATE] =
+        g_param_spec_boolean ("accumulate",
+                              "Accumulate bursts of projections",
+                              "Add each burst of projections to the reconstruction of the previous bursts",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
+    node_class->copy = ufo_backproject_task_copy_real;
     node_class->equal = ufo_backproject_task_equal_real;
 
     g_type_class_add_private(klass, sizeof(UfoBackprojectTaskPrivate));
@@ -454,16 +1161,29 @@ ufo_backproject_task_init (UfoBackprojectTask *self)
     self->priv = priv = UFO_BACKPROJECT_TASK_GET_PRIVATE (self);
     priv->nearest_kernel = NULL;
     priv->texture_kernel = NULL;
+    priv->texture_stack_kernel = NULL;
+    priv->tiled_kernel = NULL;
+    priv->store_kernel = NULL;
+    priv->half_image = NULL;
+    priv->half_supported = FALSE;
+    priv->half_precision = FALSE;
+    priv->accumulate = FALSE;
+    priv->n_accumulated = 0;
+    priv->accum_mem = NULL;
+    priv->accum_size = 0;
+    priv->host_accum = NULL;
     priv->n_projections = 0;
     priv->offset = 0;
     priv->axis_pos = -1.0;
     priv->angle_step = -1.0;
     priv->angle_offset = 0.0;
     priv->real_angle_step = -1.0;
-    priv->sin_lut = NULL;
-    priv->cos_lut = NULL;
-    priv->host_sin_lut = NULL;
-    priv->host_cos_lut = NULL;
+    priv->lut = NULL;
     priv->mode = MODE_TEXTURE;
+    priv->roi_x = 0;
+    priv->roi_y = 0;
+    priv->roi_width = 0;
+    priv->roi_height = 0;
+    priv->circular_mask = FALSE;
     priv->luts_changed = TRUE;
 }
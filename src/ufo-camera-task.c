@@ -17,6 +17,12 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
 #include <gmodule.h>
 #include <uca/uca-plugin-manager.h>
 #include <uca/uca-camera.h>
@@ -36,6 +42,12 @@ struct _UfoCameraTaskPrivate {
     gchar      *name;
     GTimer     *timer;
     gboolean    readout;
+
+    gboolean    device_conversion;
+    gpointer    raw;
+    cl_context  context;
+    cl_kernel   kernel;
+    cl_mem      raw_mem;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -53,6 +65,7 @@ enum {
     PROP_COUNT,
     PROP_TIME,
     PROP_READOUT,
+    PROP_DEVICE_CONVERSION,
     N_PROPERTIES
 };
 
@@ -96,6 +109,28 @@ create_camera (UcaPluginManager *pm,
     return camera;
 }
 
+static void
+release_conversion (UfoCameraTaskPrivate *priv)
+{
+    g_free (priv->raw);
+    priv->raw = NULL;
+
+    if (priv->raw_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->raw_mem));
+        priv->raw_mem = NULL;
+    }
+
+    if (priv->kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+}
+
 static void
 ufo_camera_task_setup (UfoTask *task,
                        UfoResources *resources,
@@ -130,6 +165,31 @@ ufo_camera_task_setup (UfoTask *task,
                   "is-recording", &is_recording,
                   NULL);
 
+    if (priv->device_conversion) {
+        gsize size;
+        cl_int err;
+
+        /* Frames are grabbed into host memory and uploaded without widening */
+        size = priv->width * priv->height * (priv->n_bits <= 8 ? 1 : 2);
+        release_conversion (priv);
+
+        priv->kernel = ufo_resources_get_kernel (resources, "default.cl",
+                                                 priv->n_bits <= 8 ? "convert_u8" : "convert_u16",
+                                                 error);
+
+        if (priv->kernel == NULL)
+            return;
+
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+
+        priv->context = ufo_resources_get_context (resources);
+        UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+        priv->raw = g_malloc (size);
+        priv->raw_mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY, size, NULL, &err);
+        UFO_RESOURCES_CHECK_CLERR (err);
+    }
+
     if (!is_recording && !priv->readout) {
         g_message ("Start recording");
         uca_camera_start_recording (priv->camera, error);
@@ -177,9 +237,40 @@ ufo_camera_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_camera_task_get_mode (UfoTask *task)
 {
+    UfoCameraTaskPrivate *priv = UFO_CAMERA_TASK_GET_PRIVATE (task);
+
+    if (priv->device_conversion)
+        return UFO_TASK_MODE_GENERATOR | UFO_TASK_MODE_GPU;
+
     return UFO_TASK_MODE_GENERATOR | UFO_TASK_MODE_CPU;
 }
 
+static void
+convert_on_device (UfoTask *task, UfoBuffer *output, UfoRequisition *requisition)
+{
+    UfoCameraTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem out_mem;
+    gsize size;
+
+    priv = UFO_CAMERA_TASK_GET_PRIVATE (task);
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    size = priv->width * priv->height * (priv->n_bits <= 8 ? 1 : 2);
+
+    /* Blocking, because the next frame is grabbed into the same memory */
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteBuffer (cmd_queue, priv->raw_mem, CL_TRUE,
+                                                     0, size, priv->raw, 0, NULL, NULL));
+
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &priv->raw_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &out_mem));
+    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims, NULL);
+}
+
 static gboolean
 ufo_camera_task_generate (UfoTask *task,
                           UfoBuffer *output,
@@ -191,10 +282,14 @@ ufo_camera_task_generate (UfoTask *task,
     priv = UFO_CAMERA_TASK_GET_PRIVATE (UFO_CAMERA_TASK (task));
 
     if (priv->current < priv->count || g_timer_elapsed (priv->timer, NULL) < priv->time) {
-        gfloat *host_array;
+        gpointer host_array;
+
+        if (priv->device_conversion)
+            host_array = priv->raw;
+        else
+            host_array = ufo_buffer_get_host_array (output, NULL);
 
-        host_array = ufo_buffer_get_host_array (output, NULL);
-        uca_camera_grab (priv->camera, (gpointer) host_array, &tmp_error);
+        uca_camera_grab (priv->camera, host_array, &tmp_error);
 
         if (tmp_error != NULL) {
             g_warning ("Could not grab frame: %s", tmp_error->message);
@@ -202,7 +297,11 @@ ufo_camera_task_generate (UfoTask *task,
             return FALSE;
         }
 
-        ufo_buffer_convert (output, priv->n_bits <= 8 ? UFO_BUFFER_DEPTH_8U : UFO_BUFFER_DEPTH_16U);
+        if (priv->device_conversion)
+            convert_on_device (task, output, requisition);
+        else
+            ufo_buffer_convert (output, priv->n_bits <= 8 ? UFO_BUFFER_DEPTH_8U : UFO_BUFFER_DEPTH_16U);
+
         priv->current++;
         return TRUE;
     }
@@ -240,6 +339,9 @@ ufo_camera_task_set_property (GObject *object,
         case PROP_READOUT:
             priv->readout = g_value_get_boolean (value);
             break;
+        case PROP_DEVICE_CONVERSION:
+            priv->device_conversion = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -270,6 +372,9 @@ ufo_camera_task_get_property (GObject *object,
         case PROP_READOUT:
             g_value_set_boolean (value, priv->readout);
             break;
+        case PROP_DEVICE_CONVERSION:
+            g_value_set_boolean (value, priv->device_conversion);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -306,6 +411,8 @@ ufo_camera_task_finalize (GObject *object)
         priv->timer = NULL;
     }
 
+    release_conversion (priv);
+
     G_OBJECT_CLASS (ufo_camera_task_parent_class)->finalize (object);
 }
 
@@ -364,6 +471,12 @@ ufo_camera_task_class_init(UfoCameraTaskClass *klass)
             "Read-out pre-recorded frames instead of starting the acquisition",
             FALSE, G_PARAM_READWRITE);
 
+    properties[PROP_DEVICE_CONVERSION] =
+        g_param_spec_boolean("device-conversion",
+            "Convert frames to float on the device",
+            "Upload frames in their native bit depth and convert them to float on the device",
+            FALSE, G_PARAM_READWRITE);
+
     for (guint i = PROP_X + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -381,4 +494,9 @@ ufo_camera_task_init (UfoCameraTask *self)
     priv->camera = NULL;
     priv->count = 0;
     priv->readout = FALSE;
+    priv->device_conversion = FALSE;
+    priv->raw = NULL;
+    priv->context = NULL;
+    priv->kernel = NULL;
+    priv->raw_mem = NULL;
 }
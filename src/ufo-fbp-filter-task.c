@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "clFFT.h"
+#include "ufo-fbp-filter-task.h"
+#include "ufo-filter-coefficients.h"
+#include "ufo-autotune.h"
+
+/**
+ * SECTION:ufo-fbp-filter-task
+ * @Short_description: Filter sinograms for filtered backprojection
+ * @Title: fbp-filter
+ *
+ * Zero-pads each row of a sinogram to the next power of two, transforms it,
+ * multiplies the spectrum with the frequency filter and transforms it back,
+ * all in one work buffer. Because the filters are real and symmetric, two
+ * real rows are filtered at once as real and imaginary part of one complex
+ * row. This replaces the #UfoFftTask, #UfoFilterTask and
+ * #UfoIfftTask chain in front of the backprojection.
+ */
+
+typedef enum {
+    FILTER_RAMP,
+    FILTER_BUTTERWORTH
+} FilterType;
+
+static const gchar *filter_names[] = { "ramp", "butterworth" };
+
+struct _UfoFbpFilterTaskPrivate {
+    cl_context context;
+    cl_kernel spread_kernel;
+    cl_kernel filter_kernel;
+    cl_kernel pack_kernel;
+    clFFT_Plan fft_plan;
+    guint fft_size;
+    cl_mem filter_mem;
+    cl_mem work_mem;
+    gsize work_size;
+
+    FilterType filter;
+    gfloat bw_cutoff;
+    gfloat bw_order;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoFbpFilterTask, ufo_fbp_filter_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_FBP_FILTER_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_FBP_FILTER_TASK, UfoFbpFilterTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_FILTER,
+    PROP_BW_CUTOFF,
+    PROP_BW_ORDER,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_fbp_filter_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_FBP_FILTER_TASK, NULL));
+}
+
+static guint32
+pow2round (guint32 x)
+{
+    --x;
+    x |= x >> 1;
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+    return x+1;
+}
+
+static void
+ufo_fbp_filter_task_setup (UfoTask *task,
+                           UfoResources *resources,
+                           GError **error)
+{
+    UfoFbpFilterTaskPrivate *priv;
+
+    priv = UFO_FBP_FILTER_TASK_GET_PRIVATE (task);
+
+    priv->spread_kernel = ufo_resources_get_kernel (resources, "fft.cl", "fft_spread_pairs", error);
+
+    if (priv->spread_kernel == NULL)
+        return;
+
+    priv->filter_kernel = ufo_resources_get_kernel (resources, "filter.cl", "filter", error);
+
+    if (priv->filter_kernel == NULL)
+        return;
+
+    priv->pack_kernel = ufo_resources_get_kernel (resources, "fft.cl", "fft_pack_pairs", error);
+
+    if (priv->pack_kernel == NULL)
+        return;
+
+    priv->context = ufo_resources_get_context (resources);
+
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->spread_kernel));
+    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->filter_kernel));
+    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->pack_kernel));
+}
+
+static void
+create_filter (UfoFbpFilterTaskPrivate *priv)
+{
+    cl_int cl_err;
+    gfloat *coefficients;
+    guint width;
+
+    width = 2 * priv->fft_size;
+    coefficients = g_malloc0 (width * sizeof (gfloat));
+
+    if (priv->filter == FILTER_BUTTERWORTH)
+        ufo_filter_coefficients_butterworth (coefficients, width, priv->bw_cutoff, priv->bw_order);
+    else
+        ufo_filter_coefficients_ramp (coefficients, width);
+
+    ufo_filter_coefficients_mirror (coefficients, width);
+
+    /* The inverse transform is not normalized, so scale the filter instead */
+    for (guint i = 0; i < width; i++)
+        coefficients[i] /= (gfloat) priv->fft_size;
+
+    priv->filter_mem = clCreateBuffer (priv->context,
+                                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                       width * sizeof (gfloat),
+                                       coefficients,
+                                       &cl_err);
+    UFO_RESOURCES_CHECK_CLERR (cl_err);
+    g_free (coefficients);
+}
+
+static void
+release_buffers (UfoFbpFilterTaskPrivate *priv)
+{
+    if (priv->fft_plan != NULL) {
+        clFFT_DestroyPlan (priv->fft_plan);
+        priv->fft_plan = NULL;
+    }
+
+    if (priv->filter_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->filter_mem));
+        priv->filter_mem = NULL;
+    }
+
+    if (priv->work_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->work_mem));
+        priv->work_mem = NULL;
+    }
+}
+
+static void
+ufo_fbp_filter_task_get_requisition (UfoTask *task,
+                                     UfoBuffer **inputs,
+                                     UfoRequisition *requisition)
+{
+    UfoFbpFilterTaskPrivate *priv;
+    guint fft_size;
+    gsize work_size;
+
+    priv = UFO_FBP_FILTER_TASK_GET_PRIVATE (task);
+    ufo_buffer_get_requisition (inputs[0], requisition);
+
+    fft_size = pow2round ((guint32) requisition->dims[0]);
+    work_size = 2 * fft_size * ((requisition->dims[1] + 1) / 2) * sizeof (gfloat);
+
+    if (fft_size != priv->fft_size)
+        release_buffers (priv);
+
+    priv->fft_size = fft_size;
+
+    if (priv->fft_plan == NULL) {
+        clFFT_Dim3 dims = { fft_size, 1, 1 };
+        cl_int cl_err;
+
+        priv->fft_plan = clFFT_CreatePlan (priv->context, dims, clFFT_1D,
+                                           clFFT_InterleavedComplexFormat, &cl_err);
+        UFO_RESOURCES_CHECK_CLERR (cl_err);
+        create_filter (priv);
+    }
+
+    if (priv->work_mem != NULL && work_size != priv->work_size) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->work_mem));
+        priv->work_mem = NULL;
+    }
+
+    if (priv->work_mem == NULL) {
+        cl_int cl_err;
+
+        priv->work_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, work_size, NULL, &cl_err);
+        UFO_RESOURCES_CHECK_CLERR (cl_err);
+        priv->work_size = work_size;
+    }
+}
+
+static guint
+ufo_fbp_filter_task_get_num_inputs (UfoTask *task)
+{
+    return 1;
+}
+
+static guint
+ufo_fbp_filter_task_get_num_dimensions (UfoTask *task,
+                                        guint input)
+{
+    g_return_val_if_fail (input == 0, 0);
+    return 2;
+}
+
+static UfoTaskMode
+ufo_fbp_filter_task_get_mode (UfoTask *task)
+{
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+}
+
+static gboolean
+ufo_fbp_filter_task_equal_real (UfoNode *n1,
+                                UfoNode *n2)
+{
+    g_return_val_if_fail (UFO_IS_FBP_FILTER_TASK (n1) && UFO_IS_FBP_FILTER_TASK (n2), FALSE);
+    return TRUE;
+}
+
+static gboolean
+ufo_fbp_filter_task_process (UfoTask *task,
+                             UfoBuffer **inputs,
+                             UfoBuffer *output,
+                             UfoRequisition *requisition)
+{
+    UfoFbpFilterTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem in_mem;
+    cl_mem out_mem;
+    cl_int width;
+    cl_int height;
+    cl_int n_rows;
+    gfloat scale = 1.0f;
+    gsize global_work_size[2];
+
+    priv = UFO_FBP_FILTER_TASK_GET_PRIVATE (task);
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+    width = (cl_int) requisition->dims[0];
+    height = (cl_int) requisition->dims[1];
+    n_rows = (height + 1) / 2;
+    global_work_size[0] = priv->fft_size;
+    global_work_size[1] = (gsize) n_rows;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 0, sizeof (cl_mem), &priv->work_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 1, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 2, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 3, sizeof (cl_int), &height));
+    ufo_autotune_call (profiler, cmd_queue, priv->spread_kernel, 2, global_work_size);
+
+    /* Commands are executed in order, so no events are needed in between */
+    clFFT_ExecuteInterleaved_Ufo (cmd_queue, priv->fft_plan, n_rows, clFFT_Forward,
+                                  priv->work_mem, priv->work_mem, 0, NULL, NULL, profiler);
+
+    /* The filter kernel indexes rows by the global width, i.e. per float */
+    global_work_size[0] = 2 * priv->fft_size;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 0, sizeof (cl_mem), &priv->work_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 1, sizeof (cl_mem), &priv->work_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 2, sizeof (cl_mem), &priv->filter_mem));
+
+    /* Filtering in place cannot be repeated for tuning */
+    ufo_profiler_call (profiler, cmd_queue, priv->filter_kernel, 2, global_work_size, NULL);
+
+    clFFT_ExecuteInterleaved_Ufo (cmd_queue, priv->fft_plan, n_rows, clFFT_Inverse,
+                                  priv->work_mem, priv->work_mem, 0, NULL, NULL, profiler);
+
+    global_work_size[0] = priv->fft_size;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 0, sizeof (cl_mem), &priv->work_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 2, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 3, sizeof (cl_int), &height));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 4, sizeof (gfloat), &scale));
+    ufo_autotune_call (profiler, cmd_queue, priv->pack_kernel, 2, global_work_size);
+
+    return TRUE;
+}
+
+static void
+ufo_fbp_filter_task_finalize (GObject *object)
+{
+    UfoFbpFilterTaskPrivate *priv;
+
+    priv = UFO_FBP_FILTER_TASK_GET_PRIVATE (object);
+
+    release_buffers (priv);
+
+    if (priv->spread_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->spread_kernel));
+        priv->spread_kernel = NULL;
+    }
+
+    if (priv->filter_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->filter_kernel));
+        priv->filter_kernel = NULL;
+    }
+
+    if (priv->pack_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->pack_kernel));
+        priv->pack_kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    G_OBJECT_CLASS (ufo_fbp_filter_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_fbp_filter_task_setup;
+    iface->get_requisition = ufo_fbp_filter_task_get_requisition;
+    iface->get_num_inputs = ufo_fbp_filter_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_fbp_filter_task_get_num_dimensions;
+    iface->get_mode = ufo_fbp_filter_task_get_mode;
+    iface->process = ufo_fbp_filter_task_process;
+}
+
+static void
+ufo_fbp_filter_task_set_property (GObject *object,
+                                  guint property_id,
+                                  const GValue *value,
+                                  GParamSpec *pspec)
+{
+    UfoFbpFilterTaskPrivate *priv = UFO_FBP_FILTER_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_FILTER:
+            {
+                const gchar *type = g_value_get_string (value);
+
+                for (guint i = 0; i < G_N_ELEMENTS (filter_names); i++) {
+                    if (!g_strcmp0 (type, filter_names[i]))
+                        priv->filter = (FilterType) i;
+                }
+            }
+            break;
+        case PROP_BW_CUTOFF:
+            priv->bw_cutoff = g_value_get_float (value);
+            break;
+        case PROP_BW_ORDER:
+            priv->bw_order = g_value_get_float (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_fbp_filter_task_get_property (GObject *object,
+                                  guint property_id,
+                                  GValue *value,
+                                  GParamSpec *pspec)
+{
+    UfoFbpFilterTaskPrivate *priv = UFO_FBP_FILTER_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_FILTER:
+            g_value_set_string (value, filter_names[priv->filter]);
+            break;
+        case PROP_BW_CUTOFF:
+            g_value_set_float (value, priv->bw_cutoff);
+            break;
+        case PROP_BW_ORDER:
+            g_value_set_float (value, priv->bw_order);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_fbp_filter_task_class_init (UfoFbpFilterTaskClass *klass)
+{
+    GObjectClass *oclass;
+    UfoNodeClass *node_class;
+
+    oclass = G_OBJECT_CLASS (klass);
+    node_class = UFO_NODE_CLASS (klass);
+
+    oclass->finalize = ufo_fbp_filter_task_finalize;
+    oclass->set_property = ufo_fbp_filter_task_set_property;
+    oclass->get_property = ufo_fbp_filter_task_get_property;
+
+    properties[PROP_FILTER] =
+        g_param_spec_string ("filter",
+            "Type of filter (\"ramp\", \"butterworth\")",
+            "Type of filter (\"ramp\", \"butterworth\")",
+            "ramp",
+            G_PARAM_READWRITE);
+
+    properties[PROP_BW_CUTOFF] =
+        g_param_spec_float ("cutoff",
+            "Relative cutoff frequency",
+            "Relative cutoff frequency of the Butterworth filter",
+            0.0f, 1.0f, 0.5f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BW_ORDER] =
+        g_param_spec_float ("order",
+            "Order of the Butterworth filter",
+            "Order of the Butterworth filter",
+            2.0f, 32.0f, 4.0f,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    node_class->equal = ufo_fbp_filter_task_equal_real;
+
+    g_type_class_add_private (klass, sizeof(UfoFbpFilterTaskPrivate));
+}
+
+static void
+ufo_fbp_filter_task_init (UfoFbpFilterTask *self)
+{
+    UfoFbpFilterTaskPrivate *priv;
+    self->priv = priv = UFO_FBP_FILTER_TASK_GET_PRIVATE (self);
+    priv->context = NULL;
+    priv->spread_kernel = NULL;
+    priv->filter_kernel = NULL;
+    priv->pack_kernel = NULL;
+    priv->fft_plan = NULL;
+    priv->fft_size = 0;
+    priv->filter_mem = NULL;
+    priv->work_mem = NULL;
+    priv->work_size = 0;
+    priv->filter = FILTER_RAMP;
+    priv->bw_cutoff = 0.5f;
+    priv->bw_order = 4.0f;
+}
@@ -31,6 +31,7 @@
 
 #include "clFFT.h"
 #include "ufo-fft-task.h"
+#include "ufo-autotune.h"
 
 
 struct _UfoFftTaskPrivate {
@@ -46,6 +47,7 @@ struct _UfoFftTaskPrivate {
     clFFT_Dim3  fft_size;
 
     gboolean auto_zeropadding;
+    gboolean pack_rows;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -63,6 +65,7 @@ enum {
     PROP_SIZE_X,
     PROP_SIZE_Y,
     PROP_SIZE_Z,
+    PROP_PACK_ROWS,
     N_PROPERTIES
 };
 
@@ -95,8 +98,16 @@ ufo_fft_task_setup (UfoTask *task,
 
     priv = UFO_FFT_TASK_GET_PRIVATE (task);
 
+    if (priv->pack_rows && (!priv->auto_zeropadding || priv->fft_dimensions != FFT_1D)) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "::pack-rows requires real input with ::auto-zeropadding and a 1D transform");
+        return;
+    }
+
     if (priv->auto_zeropadding) {
-        priv->kernel = ufo_resources_get_kernel (resources, "fft.cl", "fft_spread", error);
+        priv->kernel = ufo_resources_get_kernel (resources, "fft.cl",
+                                                 priv->pack_rows ? "fft_spread_pairs" : "fft_spread",
+                                                 error);
     }
 
     priv->context = ufo_resources_get_context (resources);
@@ -149,6 +160,9 @@ ufo_fft_task_get_requisition (UfoTask *task,
     requisition->n_dims = 2;
     requisition->dims[0] = 2 * priv->fft_size.x;
     requisition->dims[1] = priv->fft_dimensions == FFT_1D ? in_req.dims[1] : priv->fft_size.y;
+
+    if (priv->pack_rows)
+        requisition->dims[1] = (in_req.dims[1] + 1) / 2;
 }
 
 static guint
@@ -218,15 +232,12 @@ ufo_fft_task_process (UfoTask *task,
         global_work_size[0] = requisition->dims[0] >> 1;
         global_work_size[1] = requisition->dims[1];
 
-        UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue,
-                                                           priv->kernel,
-                                                           2, NULL, global_work_size, NULL,
-                                                           0, NULL, &event));
+        ufo_autotune_enqueue (cmd_queue, priv->kernel, 2, global_work_size, &event);
     }
     
     if (priv->fft_dimensions == FFT_1D) {
         clFFT_ExecuteInterleaved_Ufo (cmd_queue, priv->fft_plan,
-				      (cl_int) in_req.dims[1], clFFT_Forward,
+				      (cl_int) requisition->dims[1], clFFT_Forward,
 				      (priv->auto_zeropadding)? out_mem : in_mem, out_mem,
 				      (priv->auto_zeropadding)? 1 : 0, 
 				      (priv->auto_zeropadding)? &event : NULL, NULL, profiler);
@@ -304,6 +315,9 @@ ufo_fft_task_set_property (GObject *object,
         case PROP_SIZE_Z:
             priv->fft_size.z = g_value_get_uint (value);
             break;
+        case PROP_PACK_ROWS:
+            priv->pack_rows = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -334,6 +348,9 @@ ufo_fft_task_get_property (GObject *object,
         case PROP_SIZE_Z:
             g_value_set_uint (value, priv->fft_size.z);
             break;
+        case PROP_PACK_ROWS:
+            g_value_set_boolean (value, priv->pack_rows);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -388,6 +405,13 @@ ufo_fft_task_class_init (UfoFftTaskClass *klass)
             1, 8192, 1,
             G_PARAM_READWRITE);
 
+    properties[PROP_PACK_ROWS] =
+        g_param_spec_boolean("pack-rows",
+            "Transform two real rows as one complex row",
+            "Transform two real rows as one complex row",
+            FALSE,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -409,4 +433,5 @@ ufo_fft_task_init (UfoFftTask *self)
     priv->kernel = NULL;
 
     priv->auto_zeropadding = TRUE;
+    priv->pack_rows = FALSE;
 }
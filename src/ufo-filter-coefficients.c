@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include "ufo-filter-coefficients.h"
+
+/*
+ * Coefficients of the frequency filters used for filtered backprojection.
+ * @width is the number of floats of an interleaved complex row, i.e. twice
+ * the FFT size, and real and imaginary part share the same coefficient.
+ */
+
+void
+ufo_filter_coefficients_ramp (gfloat *filter,
+                              guint width)
+{
+    const gfloat scale = 0.25f / ((gfloat) width);
+
+    for (guint k = 1; k < width / 4; k++) {
+        filter[2*k] = ((gfloat) k) * scale;
+        filter[2*k + 1] = filter[2*k];
+    }
+}
+
+void
+ufo_filter_coefficients_butterworth (gfloat *filter,
+                                     guint width,
+                                     gfloat cutoff,
+                                     gfloat order)
+{
+    const gfloat scale = 0.25f / ((gfloat) width);
+    const guint n_samples = width / 4;
+
+    for (guint i = 0; i < n_samples; i++) {
+        const gfloat u = ((gfloat) i) / ((gfloat) n_samples);
+        filter[2*i] = ((gfloat) i) * scale;
+        filter[2*i] /= (1.0f + (gfloat) pow (u / cutoff, 2.0f * order));
+        filter[2*i+1] = filter[2*i];
+    }
+}
+
+void
+ufo_filter_coefficients_mirror (gfloat *filter,
+                                guint width)
+{
+    for (guint k = width/2; k < width; k += 2) {
+        filter[k] = filter[width - k];
+        filter[k + 1] = filter[width - k + 1];
+    }
+}
@@ -22,9 +22,9 @@
 #else
 #include <CL/cl.h>
 #endif
-#include <math.h>
-
 #include "ufo-filter-task.h"
+#include "ufo-filter-coefficients.h"
+#include "ufo-autotune.h"
 
 /**
  * SECTION:ufo-filter-task
@@ -95,7 +95,7 @@ ufo_filter_task_process (UfoTask *task,
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (cl_mem), &priv->filter_mem));
 
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
-    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims, NULL);
+    ufo_autotune_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims);
 
     return TRUE;
 }
@@ -120,26 +120,12 @@ ufo_filter_task_setup (UfoTask *task,
 
 }
 
-static void
-mirror_coefficients (gfloat *filter, guint width)
-{
-    for (guint k = width/2; k < width; k += 2) {
-        filter[k] = filter[width - k];
-        filter[k + 1] = filter[width - k + 1];
-    }
-}
-
 static void
 compute_ramp_coefficients (UfoFilterTaskPrivate *priv,
                            gfloat *filter,
                            guint width)
 {
-    const gfloat scale = 0.25f / ((gfloat) width);
-
-    for (guint k = 1; k < width / 4; k++) {
-        filter[2*k] = ((gfloat) k) * scale;
-        filter[2*k + 1] = filter[2*k];
-    }
+    ufo_filter_coefficients_ramp (filter, width);
 }
 
 static void
@@ -147,15 +133,7 @@ compute_butterworth_coefficients (UfoFilterTaskPrivate *priv,
                                   gfloat *filter,
                                   guint width)
 {
-    const gfloat scale = 0.25f / ((gfloat) width);
-    const guint n_samples = width / 4;
-
-    for (guint i = 0; i < n_samples; i++) {
-        const gfloat u = ((gfloat) i) / ((gfloat) n_samples);
-        filter[2*i] = ((gfloat) i) * scale;
-        filter[2*i] /= (1.0f + (gfloat) pow (u / priv->bw_cutoff, 2.0f * priv->bw_order));
-        filter[2*i+1] = filter[2*i];
-    }
+    ufo_filter_coefficients_butterworth (filter, width, priv->bw_cutoff, priv->bw_order);
 }
 
 static void
@@ -177,7 +155,7 @@ ufo_filter_task_get_requisition (UfoTask *task,
         coefficients = g_malloc0 (width * sizeof (gfloat));
 
         priv->setup (priv, coefficients, width);
-        mirror_coefficients (coefficients, width);
+        ufo_filter_coefficients_mirror (coefficients, width);
 
         priv->filter_mem = clCreateBuffer (priv->context,
                                            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
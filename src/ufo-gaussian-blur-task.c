@@ -24,6 +24,7 @@
 #endif
 #include <math.h>
 #include "ufo-gaussian-blur-task.h"
+#include "ufo-autotune.h"
 
 /**
  * SECTION:ufo-gaussian-blur-task
@@ -192,19 +193,13 @@ ufo_gaussian_blur_task_process (UfoTask *task,
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->h_kernel, 0, sizeof(cl_mem), &in_mem));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->h_kernel, 1, sizeof(cl_mem), &priv->intermediate_mem));
 
-    UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue,
-                                                       priv->h_kernel,
-                                                       2, NULL, requisition->dims, NULL,
-                                                       0, NULL, NULL));
+    ufo_autotune_enqueue (cmd_queue, priv->h_kernel, 2, requisition->dims, NULL);
 
     out_mem = ufo_buffer_get_device_array (output, cmd_queue);
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->v_kernel, 0, sizeof(cl_mem), &priv->intermediate_mem));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->v_kernel, 1, sizeof(cl_mem), &out_mem));
 
-    UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue,
-                                                       priv->v_kernel,
-                                                       2, NULL, requisition->dims, NULL,
-                                                       0, NULL, NULL));
+    ufo_autotune_enqueue (cmd_queue, priv->v_kernel, 2, requisition->dims, NULL);
     return TRUE;
 }
 
@@ -41,6 +41,8 @@ struct _UfoIfftTaskPrivate {
     clFFT_Plan  fft_plan;
 
     gint crop_width;
+    gint crop_height;
+    gboolean pack_rows;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -55,6 +57,8 @@ enum {
     PROP_0,
     PROP_DIMENSIONS,
     PROP_CROP_WIDTH,
+    PROP_CROP_HEIGHT,
+    PROP_PACK_ROWS,
     N_PROPERTIES
 };
 
@@ -74,7 +78,16 @@ ufo_ifft_task_setup (UfoTask *task,
     UfoIfftTaskPrivate *priv;
 
     priv = UFO_IFFT_TASK_GET_PRIVATE (task);
-    priv->kernel = ufo_resources_get_kernel (resources, "fft.cl", "fft_pack", error);
+
+    if (priv->pack_rows && priv->fft_dimensions != FFT_1D) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "::pack-rows requires a 1D transform");
+        return;
+    }
+
+    priv->kernel = ufo_resources_get_kernel (resources, "fft.cl",
+                                             priv->pack_rows ? "fft_pack_pairs" : "fft_pack",
+                                             error);
     priv->context = ufo_resources_get_context (resources);
 
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
@@ -124,7 +137,11 @@ ufo_ifft_task_get_requisition (UfoTask *task,
 
     requisition->n_dims = 2;
     requisition->dims[0] = priv->crop_width > 0 ? (gsize) priv->crop_width : fft_size.x;
-    requisition->dims[1] = in_req.dims[1];
+    requisition->dims[1] = priv->pack_rows ? 2 * in_req.dims[1] : in_req.dims[1];
+
+    /* An odd number of rows packed by fft is restored by cropping the last one */
+    if (priv->crop_height > 0)
+        requisition->dims[1] = MIN (requisition->dims[1], (gsize) priv->crop_height);
 }
 
 static guint
@@ -170,6 +187,7 @@ ufo_ifft_task_process (UfoTask *task,
     cl_mem out_mem;
     cl_int batch_size;
     cl_int width;
+    cl_int height;
     gfloat scale;
     gsize global_work_size[2];
 
@@ -179,7 +197,8 @@ ufo_ifft_task_process (UfoTask *task,
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
     in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
     out_mem = ufo_buffer_get_device_array (output, cmd_queue);
-    batch_size = priv->fft_dimensions == FFT_1D ? (cl_int) requisition->dims[1] : 1;
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+    batch_size = priv->fft_dimensions == FFT_1D ? (cl_int) in_req.dims[1] : 1;
 
     clFFT_ExecuteInterleaved_Ufo (cmd_queue,
 				  priv->fft_plan, batch_size, clFFT_Inverse,
@@ -194,14 +213,21 @@ ufo_ifft_task_process (UfoTask *task,
         scale /= (gfloat) requisition->dims[0];
 
     width = priv->crop_width > 0 ? priv->crop_width : (cl_int) requisition->dims[0];
-    ufo_buffer_get_requisition (inputs[0], &in_req);
+    height = (cl_int) requisition->dims[1];
     global_work_size[0] = in_req.dims[0] >> 1;
-    global_work_size[1] = in_req.dims[1];
+    global_work_size[1] = priv->pack_rows ? (requisition->dims[1] + 1) / 2 : requisition->dims[1];
 
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), (gpointer) &in_mem));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), (gpointer) &out_mem));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (cl_int), &width));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (gfloat), &scale));
+
+    if (priv->pack_rows) {
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (cl_int), &height));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 4, sizeof (gfloat), &scale));
+    }
+    else {
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (gfloat), &scale));
+    }
 
     UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue,
                                                        priv->kernel,
@@ -258,6 +284,12 @@ ufo_ifft_task_set_property (GObject *object,
         case PROP_CROP_WIDTH:
             priv->crop_width = g_value_get_int (value);
             break;
+        case PROP_CROP_HEIGHT:
+            priv->crop_height = g_value_get_int (value);
+            break;
+        case PROP_PACK_ROWS:
+            priv->pack_rows = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -279,6 +311,12 @@ ufo_ifft_task_get_property (GObject *object,
         case PROP_CROP_WIDTH:
             g_value_set_int (value, priv->crop_width);
             break;
+        case PROP_CROP_HEIGHT:
+            g_value_set_int (value, priv->crop_height);
+            break;
+        case PROP_PACK_ROWS:
+            g_value_set_boolean (value, priv->pack_rows);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -312,6 +350,20 @@ ufo_ifft_task_class_init (UfoIfftTaskClass *klass)
                           -1, G_MAXINT, -1,
                           G_PARAM_READWRITE);
 
+    properties[PROP_CROP_HEIGHT] =
+        g_param_spec_int ("crop-height",
+                          "Height of cropped output",
+                          "Height of cropped output",
+                          -1, G_MAXINT, -1,
+                          G_PARAM_READWRITE);
+
+    properties[PROP_PACK_ROWS] =
+        g_param_spec_boolean ("pack-rows",
+                              "Unpack two real rows from each complex row",
+                              "Unpack two real rows from each complex row",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -326,6 +378,8 @@ ufo_ifft_task_init (UfoIfftTask *self)
     UfoIfftTaskPrivate *priv;
     self->priv = priv = UFO_IFFT_TASK_GET_PRIVATE (self);
     priv->crop_width = -1;
+    priv->crop_height = -1;
+    priv->pack_rows = FALSE;
     priv->fft_dimensions = FFT_1D;
     priv->fft_plan = NULL;
     priv->kernel = NULL;
@@ -0,0 +1,474 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gmodule.h>
+#include <string.h>
+
+#include "ufo-raw-reader-task.h"
+
+
+typedef enum {
+    DTYPE_UINT8,
+    DTYPE_UINT16,
+    DTYPE_FLOAT32
+} RawDataType;
+
+struct _UfoRawReaderTaskPrivate {
+    gchar *path;
+    guint width;
+    guint height;
+    guint depth;
+    guint64 offset;
+    RawDataType dtype;
+    guint start;
+    guint end;
+    guint slab;
+
+    GMappedFile *file;
+    gchar *contents;
+    gsize slice_size;
+    guint current;
+    guint last;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoRawReaderTask, ufo_raw_reader_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_RAW_READER_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_RAW_READER_TASK, UfoRawReaderTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_PATH,
+    PROP_WIDTH,
+    PROP_HEIGHT,
+    PROP_DEPTH,
+    PROP_DTYPE,
+    PROP_OFFSET,
+    PROP_START,
+    PROP_END,
+    PROP_SLAB,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_raw_reader_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_RAW_READER_TASK, NULL));
+}
+
+static gsize
+bytes_per_pixel (RawDataType dtype)
+{
+    switch (dtype) {
+        case DTYPE_UINT8:
+            return 1;
+        case DTYPE_UINT16:
+            return 2;
+        case DTYPE_FLOAT32:
+            return 4;
+    }
+
+    return 4;
+}
+
+static void
+ufo_raw_reader_task_setup (UfoTask *task,
+                           UfoResources *resources,
+                           GError **error)
+{
+    UfoRawReaderTaskPrivate *priv;
+    GError *tmp_error = NULL;
+    gsize length;
+    guint n_slices;
+    guint end;
+    guint partition;
+    guint remainder;
+    guint index;
+    guint total;
+
+    priv = UFO_RAW_READER_TASK_GET_PRIVATE (task);
+
+    if (priv->path == NULL || priv->width == 0 || priv->height == 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Path, width and height must be set");
+        return;
+    }
+
+    if (priv->file != NULL) {
+        g_mapped_file_unref (priv->file);
+        priv->file = NULL;
+    }
+
+    /*
+     * A writable private mapping is never written back to the file, but allows
+     * downstream tasks to modify the buffers that point into it.
+     */
+    priv->file = g_mapped_file_new (priv->path, TRUE, &tmp_error);
+
+    if (tmp_error != NULL) {
+        g_propagate_error (error, tmp_error);
+        return;
+    }
+
+    length = g_mapped_file_get_length (priv->file);
+    priv->contents = g_mapped_file_get_contents (priv->file);
+    priv->slice_size = (gsize) priv->width * priv->height * bytes_per_pixel (priv->dtype);
+
+    if (priv->offset >= length) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Offset is beyond the end of `%s'", priv->path);
+        return;
+    }
+
+    n_slices = (guint) ((length - priv->offset) / priv->slice_size);
+
+    if (priv->depth > 0) {
+        if (priv->depth > n_slices) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                         "`%s' is too small for %u slices", priv->path, priv->depth);
+            return;
+        }
+
+        n_slices = priv->depth;
+    }
+
+    end = MIN (priv->end, n_slices);
+
+    if (end <= priv->start) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "No slices between start and end");
+        return;
+    }
+
+    /* Partition whole slabs, so that every slab is read exactly once */
+    n_slices = end - priv->start;
+    n_slices = (n_slices + priv->slab - 1) / priv->slab;
+    ufo_task_node_get_partition (UFO_TASK_NODE (task), &index, &total);
+    partition = n_slices / total;
+    remainder = n_slices % total;
+    priv->current = priv->start + (index * partition + MIN (index, remainder)) * priv->slab;
+    priv->last = MIN (end, priv->current + (partition + (index < remainder ? 1 : 0)) * priv->slab);
+}
+
+static void
+ufo_raw_reader_task_get_requisition (UfoTask *task,
+                                     UfoBuffer **inputs,
+                                     UfoRequisition *requisition)
+{
+    UfoRawReaderTaskPrivate *priv;
+
+    priv = UFO_RAW_READER_TASK_GET_PRIVATE (task);
+    requisition->dims[0] = priv->width;
+    requisition->dims[1] = priv->height;
+
+    if (priv->slab > 1) {
+        /* The last slab may be shorter */
+        requisition->n_dims = 3;
+        requisition->dims[2] = priv->current < priv->last ? MIN (priv->slab, priv->last - priv->current) : 1;
+    }
+    else
+        requisition->n_dims = 2;
+}
+
+static guint
+ufo_raw_reader_task_get_num_inputs (UfoTask *task)
+{
+    return 0;
+}
+
+static guint
+ufo_raw_reader_task_get_num_dimensions (UfoTask *task,
+                                        guint input)
+{
+    return 0;
+}
+
+static UfoTaskMode
+ufo_raw_reader_task_get_mode (UfoTask *task)
+{
+    return UFO_TASK_MODE_GENERATOR | UFO_TASK_MODE_CPU;
+}
+
+static gboolean
+ufo_raw_reader_task_generate (UfoTask *task,
+                              UfoBuffer *output,
+                              UfoRequisition *requisition)
+{
+    UfoRawReaderTaskPrivate *priv;
+    gchar *src;
+    guint n_slices;
+
+    priv = UFO_RAW_READER_TASK_GET_PRIVATE (task);
+
+    if (priv->current >= priv->last)
+        return FALSE;
+
+    n_slices = requisition->n_dims == 3 ? (guint) requisition->dims[2] : 1;
+    src = priv->contents + priv->offset + priv->current * priv->slice_size;
+
+    if (priv->dtype == DTYPE_FLOAT32 && (priv->offset % sizeof (gfloat)) == 0) {
+        /* Hand out the mapped pages themselves, they are only read on access */
+        ufo_buffer_set_host_array (output, src, FALSE);
+    }
+    else {
+        UfoProfiler *profiler;
+
+        profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+        ufo_profiler_start (profiler, UFO_PROFILER_TIMER_IO);
+        memcpy (ufo_buffer_get_host_array (output, NULL), src, n_slices * priv->slice_size);
+        ufo_profiler_stop (profiler, UFO_PROFILER_TIMER_IO);
+
+        if (priv->dtype != DTYPE_FLOAT32)
+            ufo_buffer_convert (output, priv->dtype == DTYPE_UINT8 ? UFO_BUFFER_DEPTH_8U : UFO_BUFFER_DEPTH_16U);
+    }
+
+    priv->current += n_slices;
+    return TRUE;
+}
+
+static void
+ufo_raw_reader_task_set_property (GObject *object,
+                                  guint property_id,
+                                  const GValue *value,
+                                  GParamSpec *pspec)
+{
+    UfoRawReaderTaskPrivate *priv = UFO_RAW_READER_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_PATH:
+            g_free (priv->path);
+            priv->path = g_value_dup_string (value);
+            break;
+        case PROP_WIDTH:
+            priv->width = g_value_get_uint (value);
+            break;
+        case PROP_HEIGHT:
+            priv->height = g_value_get_uint (value);
+            break;
+        case PROP_DEPTH:
+            priv->depth = g_value_get_uint (value);
+            break;
+        case PROP_DTYPE:
+            if (!g_strcmp0 (g_value_get_string (value), "uint8"))
+                priv->dtype = DTYPE_UINT8;
+            else if (!g_strcmp0 (g_value_get_string (value), "uint16"))
+                priv->dtype = DTYPE_UINT16;
+            else if (!g_strcmp0 (g_value_get_string (value), "float32"))
+                priv->dtype = DTYPE_FLOAT32;
+            break;
+        case PROP_OFFSET:
+            priv->offset = g_value_get_uint64 (value);
+            break;
+        case PROP_START:
+            priv->start = g_value_get_uint (value);
+            break;
+        case PROP_END:
+            priv->end = g_value_get_uint (value);
+            break;
+        case PROP_SLAB:
+            priv->slab = g_value_get_uint (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_raw_reader_task_get_property (GObject *object,
+                                  guint property_id,
+                                  GValue *value,
+                                  GParamSpec *pspec)
+{
+    UfoRawReaderTaskPrivate *priv = UFO_RAW_READER_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_PATH:
+            g_value_set_string (value, priv->path);
+            break;
+        case PROP_WIDTH:
+            g_value_set_uint (value, priv->width);
+            break;
+        case PROP_HEIGHT:
+            g_value_set_uint (value, priv->height);
+            break;
+        case PROP_DEPTH:
+            g_value_set_uint (value, priv->depth);
+            break;
+        case PROP_DTYPE:
+            switch (priv->dtype) {
+                case DTYPE_UINT8:
+                    g_value_set_string (value, "uint8");
+                    break;
+                case DTYPE_UINT16:
+                    g_value_set_string (value, "uint16");
+                    break;
+                case DTYPE_FLOAT32:
+                    g_value_set_string (value, "float32");
+                    break;
+            }
+            break;
+        case PROP_OFFSET:
+            g_value_set_uint64 (value, priv->offset);
+            break;
+        case PROP_START:
+            g_value_set_uint (value, priv->start);
+            break;
+        case PROP_END:
+            g_value_set_uint (value, priv->end);
+            break;
+        case PROP_SLAB:
+            g_value_set_uint (value, priv->slab);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_raw_reader_task_finalize (GObject *object)
+{
+    UfoRawReaderTaskPrivate *priv = UFO_RAW_READER_TASK_GET_PRIVATE (object);
+
+    if (priv->file != NULL) {
+        g_mapped_file_unref (priv->file);
+        priv->file = NULL;
+    }
+
+    g_free (priv->path);
+    priv->path = NULL;
+
+    G_OBJECT_CLASS (ufo_raw_reader_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_raw_reader_task_setup;
+    iface->get_num_inputs = ufo_raw_reader_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_raw_reader_task_get_num_dimensions;
+    iface->get_mode = ufo_raw_reader_task_get_mode;
+    iface->get_requisition = ufo_raw_reader_task_get_requisition;
+    iface->generate = ufo_raw_reader_task_generate;
+}
+
+static void
+ufo_raw_reader_task_class_init (UfoRawReaderTaskClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->set_property = ufo_raw_reader_task_set_property;
+    gobject_class->get_property = ufo_raw_reader_task_get_property;
+    gobject_class->finalize = ufo_raw_reader_task_finalize;
+
+    properties[PROP_PATH] =
+        g_param_spec_string("path",
+            "Path of the raw file",
+            "Path of the raw file",
+            "",
+            G_PARAM_READWRITE);
+
+    properties[PROP_WIDTH] =
+        g_param_spec_uint("width",
+            "Width of a slice",
+            "Width of a slice",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HEIGHT] =
+        g_param_spec_uint("height",
+            "Height of a slice",
+            "Height of a slice",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_DEPTH] =
+        g_param_spec_uint("depth",
+            "Number of slices in the file",
+            "Number of slices in the file, if 0 it is computed from the file size",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_DTYPE] =
+        g_param_spec_string("dtype",
+            "Data type",
+            "Data type from: \"uint8\", \"uint16\", \"float32\"",
+            "float32",
+            G_PARAM_READWRITE);
+
+    properties[PROP_OFFSET] =
+        g_param_spec_uint64("offset",
+            "Offset in bytes",
+            "Number of bytes to skip before the first slice",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_START] =
+        g_param_spec_uint("start",
+            "First slice",
+            "First slice",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_END] =
+        g_param_spec_uint("end",
+            "Last slice (exclusive)",
+            "Last slice (exclusive)",
+            1, G_MAXUINT, G_MAXUINT,
+            G_PARAM_READWRITE);
+
+    properties[PROP_SLAB] =
+        g_param_spec_uint("slab",
+            "Number of slices per output",
+            "Number of slices per output, values greater than 1 produce three-dimensional buffers",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (gobject_class, i, properties[i]);
+
+    g_type_class_add_private (gobject_class, sizeof(UfoRawReaderTaskPrivate));
+}
+
+static void
+ufo_raw_reader_task_init(UfoRawReaderTask *self)
+{
+    UfoRawReaderTaskPrivate *priv = NULL;
+
+    self->priv = priv = UFO_RAW_READER_TASK_GET_PRIVATE (self);
+    priv->path = NULL;
+    priv->width = 0;
+    priv->height = 0;
+    priv->depth = 0;
+    priv->offset = 0;
+    priv->dtype = DTYPE_FLOAT32;
+    priv->start = 0;
+    priv->end = G_MAXUINT;
+    priv->slab = 1;
+    priv->file = NULL;
+    priv->contents = NULL;
+    priv->current = 0;
+    priv->last = 0;
+}
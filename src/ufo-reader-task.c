@@ -17,149 +17,1314 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
 #include <gmodule.h>
 #include <stdlib.h>
 #include <string.h>
 #include <tiffio.h>
 #include <glob.h>
+#include <omp.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ufo-reader-task.h"
+
+
+/*
+ * An entry of the file index. Dimensions, bit depth and number of pages are
+ * zero until the file has been opened once or the entry was loaded from an
+ * index file. Dimensions and bit depth are those of the first page.
+ */
+typedef struct {
+    gchar *filename;
+    guint32 width;
+    guint32 height;
+    guint16 bps;
+    guint n_pages;
+} ReaderEntry;
+
+/*
+ * A frame describes one page of a file, or all pages in volume mode, that is
+ * either read synchronously by the pipeline thread or decoded ahead of time by
+ * one of the prefetch threads. Its data member is only used in the latter
+ * case.
+ */
+typedef struct {
+    ReaderEntry *entry;
+    guint page;
+    guint n_pages;
+    GMappedFile *edf;
+    TIFF *tiff;
+    gboolean shared_tiff;
+    gboolean big_endian;
+    guint32 width;
+    guint32 height;
+    guint16 bps;
+    guint16 spp;
+    gsize size;
+    guint32 rows;
+    gsize dims[3];
+
+    gpointer data;
+    gpointer scratch;
+    gboolean converted;
+    gboolean ready;
+    gboolean success;
+} ReaderFrame;
+
+typedef enum {
+    BINNING_SUM,
+    BINNING_MEAN
+} BinningMode;
+
+#define EDF_HEADER_SIZE 1024
+
+/*
+ * Geometry of the last parsed EDF header. As long as the following files have
+ * the same size and the same header bytes, the layout is reused without
+ * parsing.
+ */
+typedef struct {
+    gchar prefix[EDF_HEADER_SIZE];
+    gsize file_size;
+    guint32 width;
+    guint32 height;
+    gsize size;
+    gboolean big_endian;
+} EdfHeader;
+
+struct _UfoReaderTaskPrivate {
+    gchar *path;
+    guint current_count;
+    guint step;
+    guint start;
+    guint end;
+    gboolean blocking;
+    gboolean normalize;
+    gboolean volume;
+
+    gchar *index_path;
+    gchar *pattern;
+    gint64 index_mtime;
+    GPtrArray *index;
+    GPtrArray *entries;
+    gint index_changed;
+
+    guint32 width;
+    guint32 height;
+    guint depth;
+    gboolean enable_conversion;
+
+    guint roi_x;
+    guint roi_y;
+    guint roi_width;
+    guint roi_height;
+    guint binning;
+    BinningMode binning_mode;
+
+    guint n_threads;
+    guint n_prefetch;
+    guint n_strip_threads;
+    GThreadPool *pool;
+    ReaderFrame *frames;
+    guint n_frames;
+    guint n_submitted;
+    guint next_entry;
+    guint last_entry;
+    ReaderEntry *page_entry;
+    guint page_entry_count;
+    guint next_page;
+    TIFF *cursor_tiff;
+    ReaderEntry *cursor_entry;
+    guint cursor_page;
+    gboolean cursor_busy;
+    GCond cursor_cond;
+    gchar *counter_path;
+    guint chunk_size;
+    gboolean claimed_any;
+    GMutex lock;
+    GCond ready_cond;
+
+    EdfHeader edf_header;
+
+    gboolean device_conversion;
+    cl_context context;
+    cl_kernel convert_u8_kernel;
+    cl_kernel convert_u16_kernel;
+    cl_mem raw_mem;
+    gsize raw_size;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoReaderTask, ufo_reader_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_READER_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_READER_TASK, UfoReaderTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_PATH,
+    PROP_BLOCKING,
+    PROP_START,
+    PROP_END,
+    PROP_STEP,
+    PROP_NORMALIZE,
+    PROP_ROI_Y,
+    PROP_ROI_HEIGHT,
+    PROP_ROI_X,
+    PROP_ROI_WIDTH,
+    PROP_BINNING,
+    PROP_BINNING_MODE,
+    PROP_TOTAL_HEIGHT,
+    PROP_ENABLE_CONVERSION,
+    PROP_NUM_THREADS,
+    PROP_PREFETCH,
+    PROP_STRIP_THREADS,
+    PROP_INDEX,
+    PROP_COUNTER_FILE,
+    PROP_CHUNK_SIZE,
+    PROP_VOLUME,
+    PROP_DEVICE_CONVERSION,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_reader_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_READER_TASK, NULL));
+}
+
+static gsize
+bytes_per_sample (guint16 bps)
+{
+    if (bps <= 8)
+        return 1;
+
+    return bps <= 16 ? 2 : 4;
+}
+
+/*
+ * Decode every stride'th strip that overlaps the region of interest, starting
+ * with the offset'th one. Strips that lie completely inside the region are
+ * decoded straight into the destination buffer.
+ */
+static gboolean
+read_tiff_strips (TIFF *tiff, ReaderFrame *frame, guint roi_y, gchar *buffer, guint offset, guint stride)
+{
+    const gsize row_size = frame->width * bytes_per_sample (frame->bps);
+    const guint32 roi_end = roi_y + frame->rows;
+    guint32 rows_per_strip;
+    guint32 first;
+    guint32 last;
+    gchar *strip_buffer = NULL;
+    gboolean success = TRUE;
+
+    TIFFGetFieldDefaulted (tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    rows_per_strip = MAX (1, MIN (rows_per_strip, frame->height));
+    first = roi_y / rows_per_strip;
+    last = (roi_end - 1) / rows_per_strip;
+
+    for (guint32 strip = first + offset; success && strip <= last; strip += stride) {
+        const guint32 strip_start = strip * rows_per_strip;
+        const guint32 strip_end = MIN (strip_start + rows_per_strip, frame->height);
+        const guint32 start = MAX (strip_start, roi_y);
+        const guint32 end = MIN (strip_end, roi_end);
+        const gsize size = (end - start) * row_size;
+        gchar *dst = buffer + (start - roi_y) * row_size;
+
+        if (start == strip_start && end == strip_end) {
+            success = TIFFReadEncodedStrip (tiff, strip, dst, (tmsize_t) size) != -1;
+        }
+        else {
+            if (strip_buffer == NULL)
+                strip_buffer = g_malloc ((gsize) TIFFStripSize (tiff));
+
+            success = TIFFReadEncodedStrip (tiff, strip, strip_buffer, -1) != -1;
+
+            if (success)
+                memcpy (dst, strip_buffer + (start - strip_start) * row_size, size);
+        }
+    }
+
+    g_free (strip_buffer);
+    return success;
+}
+
+/*
+ * Decode every stride'th row of tiles that overlaps the region of interest,
+ * starting with the offset'th one.
+ */
+static gboolean
+read_tiff_tiles (TIFF *tiff, ReaderFrame *frame, guint roi_y, gchar *buffer, guint offset, guint stride)
+{
+    const gsize bytes = bytes_per_sample (frame->bps);
+    const gsize row_size = frame->width * bytes;
+    const guint32 roi_end = roi_y + frame->rows;
+    guint32 tile_width;
+    guint32 tile_height;
+    gchar *tile;
+    gboolean success = TRUE;
+
+    TIFFGetField (tiff, TIFFTAG_TILEWIDTH, &tile_width);
+    TIFFGetField (tiff, TIFFTAG_TILELENGTH, &tile_height);
+    tile = g_malloc ((gsize) TIFFTileSize (tiff));
+
+    for (guint32 ty = (roi_y / tile_height + offset) * tile_height; success && ty < roi_end; ty += stride * tile_height) {
+        const guint32 start = MAX (ty, roi_y);
+        const guint32 end = MIN (ty + tile_height, roi_end);
+
+        for (guint32 tx = 0; success && tx < frame->width; tx += tile_width) {
+            const gsize n_bytes = MIN (tile_width, frame->width - tx) * bytes;
+
+            success = TIFFReadEncodedTile (tiff, TIFFComputeTile (tiff, tx, ty, 0, 0), tile, -1) != -1;
+
+            for (guint32 y = start; success && y < end; y++)
+                memcpy (buffer + (y - roi_y) * row_size + tx * bytes,
+                        tile + (y - ty) * tile_width * bytes, n_bytes);
+        }
+    }
+
+    g_free (tile);
+    return success;
+}
+
+static gboolean
+read_tiff_chunks (TIFF *tiff, ReaderFrame *frame, guint roi_y, gpointer buffer, guint offset, guint stride)
+{
+    if (TIFFIsTiled (tiff))
+        return read_tiff_tiles (tiff, frame, roi_y, buffer, offset, stride);
+
+    return read_tiff_strips (tiff, frame, roi_y, buffer, offset, stride);
+}
+
+static gboolean
+read_tiff_data (UfoReaderTaskPrivate *priv, ReaderFrame *frame, guint roi_y, gpointer buffer)
+{
+    guint16 compression = COMPRESSION_NONE;
+    gint n_threads;
+    toff_t offset;
+    gboolean success = TRUE;
+
+    TIFFGetFieldDefaulted (frame->tiff, TIFFTAG_COMPRESSION, &compression);
+
+    /* Decoding uncompressed data is bound by I/O, more threads do not help */
+    if (compression == COMPRESSION_NONE || priv->n_strip_threads < 2)
+        return read_tiff_chunks (frame->tiff, frame, roi_y, buffer, 0, 1);
+
+    /* A TIFF handle cannot be shared, so every additional thread opens its own */
+    n_threads = (gint) priv->n_strip_threads;
+    offset = TIFFCurrentDirOffset (frame->tiff);
+
+#pragma omp parallel num_threads(n_threads) reduction(&&:success)
+    {
+        guint tid = (guint) omp_get_thread_num ();
+        TIFF *tiff = tid == 0 ? frame->tiff : TIFFOpen (frame->entry->filename, "r");
+
+        /* Seek the directory by offset instead of walking all directories before it */
+        if (tiff != NULL && tid > 0 && !TIFFSetSubDirectory (tiff, offset)) {
+            TIFFClose (tiff);
+            tiff = NULL;
+        }
+
+        if (tiff != NULL) {
+            success = read_tiff_chunks (tiff, frame, roi_y, buffer, tid, (guint) omp_get_num_threads ());
+
+            if (tid > 0)
+                TIFFClose (tiff);
+        }
+        else
+            success = FALSE;
+    }
+
+    return success;
+}
+
+static gboolean
+is_tiff_file (const gchar *filename)
+{
+    return g_str_has_suffix (filename, ".tiff") ||
+           g_str_has_suffix (filename, ".tif");
+}
+
+static gboolean
+is_edf_file (const gchar *filename)
+{
+    return g_str_has_suffix (filename, ".edf");
+}
+
+static gboolean
+has_valid_extension (const gchar *filename)
+{
+    return is_tiff_file (filename) || is_edf_file (filename);
+}
+
+/*
+ * Index files start with a magic line, followed by the glob pattern and the
+ * modification time of the directory at the time of globbing. Each following
+ * line describes one file as "width height bps pages filename".
+ */
+#define INDEX_MAGIC "# ufo-reader index 2"
+
+static void
+free_entry (ReaderEntry *entry)
+{
+    g_free (entry->filename);
+    g_free (entry);
+}
+
+static gchar *
+build_pattern (const gchar *path)
+{
+    if (!has_valid_extension (path) && (g_strrstr (path, "*") == NULL))
+        return g_build_filename (path, "*", NULL);
+
+    return g_strdup (path);
+}
+
+/*
+ * Return the modification time of the directory containing pattern or -1 if
+ * it cannot be determined, e.g. because the directory itself is a pattern.
+ */
+static gint64
+get_directory_mtime (const gchar *pattern)
+{
+    gchar *dirname;
+    struct stat buf;
+    gint64 mtime = -1;
+
+    dirname = g_path_get_dirname (pattern);
+
+    if (strpbrk (dirname, "*?[") == NULL && stat (dirname, &buf) == 0)
+        mtime = (gint64) buf.st_mtime;
+
+    g_free (dirname);
+    return mtime;
+}
+
+static GPtrArray *
+glob_index (const gchar *pattern)
+{
+    GPtrArray *index;
+    glob_t glob_vector;
+
+    glob (pattern, GLOB_MARK | GLOB_TILDE, NULL, &glob_vector);
+    index = g_ptr_array_sized_new ((guint) glob_vector.gl_pathc);
+    g_ptr_array_set_free_func (index, (GDestroyNotify) free_entry);
+
+    for (gsize i = 0; i < glob_vector.gl_pathc; i++) {
+        ReaderEntry *entry = g_new0 (ReaderEntry, 1);
+
+        entry->filename = g_strdup (glob_vector.gl_pathv[i]);
+        g_ptr_array_add (index, entry);
+    }
+
+    globfree (&glob_vector);
+    return index;
+}
+
+static GPtrArray *
+load_index (const gchar *path, const gchar *pattern, gint64 mtime)
+{
+    GPtrArray *index;
+    gchar *contents;
+    gchar **lines;
+
+    if (mtime < 0 || !g_file_get_contents (path, &contents, NULL, NULL))
+        return NULL;
+
+    lines = g_strsplit (contents, "\n", 0);
+    g_free (contents);
+
+    if (g_strv_length (lines) < 3 ||
+        g_strcmp0 (lines[0], INDEX_MAGIC) ||
+        !g_str_has_prefix (lines[1], "pattern ") ||
+        g_strcmp0 (lines[1] + 8, pattern) ||
+        !g_str_has_prefix (lines[2], "mtime ") ||
+        g_ascii_strtoll (lines[2] + 6, NULL, 10) != mtime) {
+        g_strfreev (lines);
+        return NULL;
+    }
+
+    index = g_ptr_array_sized_new (g_strv_length (lines) - 3);
+    g_ptr_array_set_free_func (index, (GDestroyNotify) free_entry);
+
+    for (guint i = 3; lines[i] != NULL; i++) {
+        ReaderEntry *entry;
+        guint width, height, bps, n_pages;
+        gint n_chars;
+
+        if (sscanf (lines[i], "%u %u %u %u %n", &width, &height, &bps, &n_pages, &n_chars) != 4)
+            continue;
+
+        entry = g_new0 (ReaderEntry, 1);
+        entry->filename = g_strdup (lines[i] + n_chars);
+        entry->width = width;
+        entry->height = height;
+        entry->bps = (guint16) bps;
+        entry->n_pages = n_pages;
+        g_ptr_array_add (index, entry);
+    }
+
+    g_strfreev (lines);
+    return index;
+}
+
+static void
+save_index (UfoReaderTaskPrivate *priv)
+{
+    GString *str;
+    GError *error = NULL;
+
+    if (priv->index_mtime < 0)
+        return;
+
+    str = g_string_new (INDEX_MAGIC "\n");
+    g_string_append_printf (str, "pattern %s\nmtime %" G_GINT64_FORMAT "\n",
+                            priv->pattern, priv->index_mtime);
+
+    for (guint i = 0; i < priv->index->len; i++) {
+        ReaderEntry *entry = g_ptr_array_index (priv->index, i);
+
+        g_string_append_printf (str, "%u %u %u %u %s\n",
+                                entry->width, entry->height, (guint) entry->bps,
+                                entry->n_pages, entry->filename);
+    }
+
+    if (!g_file_set_contents (priv->index_path, str->str, (gssize) str->len, &error)) {
+        g_warning ("Could not write index: %s", error->message);
+        g_error_free (error);
+    }
+
+    g_string_free (str, TRUE);
+}
+
+static void
+free_index (UfoReaderTaskPrivate *priv)
+{
+    if (priv->entries != NULL) {
+        g_ptr_array_free (priv->entries, TRUE);
+        priv->entries = NULL;
+    }
+
+    if (priv->index != NULL) {
+        if (priv->index_path != NULL && priv->index_changed)
+            save_index (priv);
+
+        g_ptr_array_free (priv->index, TRUE);
+        priv->index = NULL;
+    }
+
+    g_free (priv->pattern);
+    priv->pattern = NULL;
+}
+
+static void
+read_index (UfoReaderTaskPrivate *priv)
+{
+    guint end;
+
+    free_index (priv);
+
+    priv->pattern = build_pattern (priv->path);
+    priv->index_mtime = get_directory_mtime (priv->pattern);
+    priv->index_changed = FALSE;
+
+    if (priv->index_path != NULL)
+        priv->index = load_index (priv->index_path, priv->pattern, priv->index_mtime);
+
+    if (priv->index == NULL) {
+        priv->index = glob_index (priv->pattern);
+        priv->index_changed = TRUE;
+    }
+
+    end = MIN (priv->end, priv->index->len);
+    priv->entries = g_ptr_array_new ();
+
+    for (guint i = priv->start; i < end; i += priv->step) {
+        ReaderEntry *entry = g_ptr_array_index (priv->index, i);
+
+        if (has_valid_extension (entry->filename))
+            g_ptr_array_add (priv->entries, entry);
+        else
+            g_warning ("Ignoring `%s'", entry->filename);
+    }
+}
+
+static void
+parse_edf_header (EdfHeader *header, const gchar *contents, gsize length)
+{
+    gchar *text;
+    gchar **tokens;
+
+    /* The mapped file is not NUL-terminated, so parse a copy of the header */
+    text = g_strndup (contents, MIN (length, EDF_HEADER_SIZE));
+    tokens = g_strsplit (text, ";", 0);
+    header->big_endian = FALSE;
+
+    for (guint i = 0; tokens[i] != NULL; i++) {
+        gchar **key_value = g_strsplit (tokens[i], "=", 0);
+
+        if (key_value[0] == NULL || key_value[1] == NULL) {
+            g_strfreev (key_value);
+            continue;
+        }
+
+        if (g_strcmp0 (g_strstrip (key_value[0]), "Dim_1") == 0)
+            header->width = (guint) atoi (key_value[1]);
+        else if (g_strcmp0 (g_strstrip (key_value[0]), "Dim_2") == 0)
+            header->height = (guint) atoi (key_value[1]);
+        else if (g_strcmp0 (g_strstrip (key_value[0]), "Size") == 0)
+            header->size = (guint) atoi (key_value[1]);
+        else if ((g_strcmp0 (g_strstrip (key_value[0]), "ByteOrder") == 0) &&
+                 (g_strcmp0 (g_strstrip (key_value[1]), "HighByteFirst") == 0))
+            header->big_endian = TRUE;
+
+        g_strfreev (key_value);
+    }
+
+    g_strfreev (tokens);
+    g_free (text);
+}
+
+static gboolean
+read_edf_metadata (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    EdfHeader header;
+    const gchar *contents;
+    gsize length;
+
+    contents = g_mapped_file_get_contents (frame->edf);
+    length = g_mapped_file_get_length (frame->edf);
+
+    if (length < EDF_HEADER_SIZE)
+        return FALSE;
+
+    g_mutex_lock (&priv->lock);
+    header = priv->edf_header;
+    g_mutex_unlock (&priv->lock);
+
+    if (header.file_size != length || memcmp (header.prefix, contents, EDF_HEADER_SIZE)) {
+        parse_edf_header (&header, contents, length);
+        memcpy (header.prefix, contents, EDF_HEADER_SIZE);
+        header.file_size = length;
+
+        g_mutex_lock (&priv->lock);
+        priv->edf_header = header;
+        g_mutex_unlock (&priv->lock);
+    }
+
+    if (header.size > length || header.size < header.width * header.height * 4)
+        return FALSE;
+
+    frame->width = header.width;
+    frame->height = header.height;
+    frame->size = header.size;
+    frame->big_endian = header.big_endian;
+    frame->bps = 32;
+    frame->spp = 1;
+    return TRUE;
+}
+
+/*
+ * Copy and byte swap in one pass. The loop body is simple enough to be turned
+ * into vector byte shuffles by the compiler.
+ */
+static void
+swap_copy_32 (guint32 *dst, const guint32 *src, gsize n)
+{
+#pragma omp simd
+    for (gsize i = 0; i < n; i++)
+        dst[i] = GUINT32_SWAP_LE_BE (src[i]);
+}
+
+static gboolean
+read_edf_data (ReaderFrame *frame,
+               guint roi_y,
+               gpointer buffer)
+{
+    const gchar *contents;
+    gsize file_size;
+    gsize header_size;
+    /* Offset to the first row */
+    gsize offset;
+    /* size of the image cropped by ROI */
+    gsize size;
+
+    contents = g_mapped_file_get_contents (frame->edf);
+    file_size = g_mapped_file_get_length (frame->edf);
+    header_size = file_size - frame->size;
+    offset = header_size + frame->width * roi_y * frame->bps / 8;
+    size = frame->width * frame->rows * frame->bps / 8;
+
+    if (offset + size > file_size)
+        return FALSE;
+
+    /* Rows are contiguous, so the region of interest is a single block */
+    if ((G_BYTE_ORDER == G_LITTLE_ENDIAN) && frame->big_endian)
+        swap_copy_32 (buffer, (const guint32 *) (gconstpointer) (contents + offset), size / 4);
+    else
+        memcpy (buffer, contents + offset, size);
+
+    return TRUE;
+}
+
+/*
+ * In stream mode, the pages of a multi-page TIFF file are read through one
+ * handle that steps to the next page with TIFFReadDirectory, because setting a
+ * page on a new handle walks all directories before it. While a prefetch
+ * thread reads an earlier page, later pages wait for the handle. Pages that
+ * come too late open their own handle.
+ */
+static TIFF *
+acquire_page_handle (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    TIFF *tiff = NULL;
+    guint page = 0;
+
+    g_mutex_lock (&priv->lock);
+
+    /* While busy, cursor_page is the page that the holder is reading */
+    while (priv->cursor_entry == frame->entry && priv->cursor_busy &&
+           priv->cursor_page < frame->page)
+        g_cond_wait (&priv->cursor_cond, &priv->lock);
+
+    if (!priv->cursor_busy) {
+        if (priv->cursor_entry != frame->entry) {
+            if (priv->cursor_tiff != NULL)
+                TIFFClose (priv->cursor_tiff);
+
+            priv->cursor_tiff = NULL;
+            priv->cursor_entry = frame->entry;
+            priv->cursor_page = 0;
+            frame->shared_tiff = TRUE;
+        }
+        else if (priv->cursor_page <= frame->page) {
+            tiff = priv->cursor_tiff;
+            page = priv->cursor_page;
+            priv->cursor_tiff = NULL;
+            frame->shared_tiff = TRUE;
+        }
+
+        if (frame->shared_tiff) {
+            priv->cursor_busy = TRUE;
+            priv->cursor_page = frame->page;
+        }
+    }
+
+    g_mutex_unlock (&priv->lock);
+
+    if (tiff == NULL) {
+        tiff = TIFFOpen (frame->entry->filename, "r");
+        page = 0;
+    }
+
+    for (; tiff != NULL && page < frame->page; page++) {
+        if (!TIFFReadDirectory (tiff)) {
+            g_warning ("`%s' has no page %u", frame->entry->filename, frame->page);
+            TIFFClose (tiff);
+            tiff = NULL;
+        }
+    }
+
+    return tiff;
+}
+
+static void
+release_page_handle (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    g_mutex_lock (&priv->lock);
+    priv->cursor_tiff = frame->tiff;
+    priv->cursor_page = frame->page;
+    priv->cursor_busy = FALSE;
+
+    /* Without a handle, later pages have nothing to wait for */
+    if (frame->tiff == NULL)
+        priv->cursor_entry = NULL;
+
+    g_cond_broadcast (&priv->cursor_cond);
+    g_mutex_unlock (&priv->lock);
+
+    frame->tiff = NULL;
+    frame->shared_tiff = FALSE;
+}
+
+static void
+close_cursor (UfoReaderTaskPrivate *priv)
+{
+    if (priv->cursor_tiff != NULL) {
+        TIFFClose (priv->cursor_tiff);
+        priv->cursor_tiff = NULL;
+    }
+
+    priv->cursor_entry = NULL;
+    priv->cursor_busy = FALSE;
+}
+
+static void
+close_frame (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    if (frame->shared_tiff) {
+        release_page_handle (priv, frame);
+    }
+    else if (frame->tiff != NULL) {
+        TIFFClose (frame->tiff);
+        frame->tiff = NULL;
+    }
+
+    if (frame->edf != NULL) {
+        g_mapped_file_unref (frame->edf);
+        frame->edf = NULL;
+    }
+}
+
+/*
+ * Compute the output size of an image with the given size after cropping and
+ * binning. rows is set to the number of rows that have to be decoded starting
+ * at roi_y.
+ */
+static gboolean
+get_output_dims (UfoReaderTaskPrivate *priv, guint32 width, guint32 height, gsize *dims, guint32 *rows)
+{
+    guint32 roi_width;
+    guint32 roi_height;
+
+    if (priv->roi_x >= width || priv->roi_y >= height)
+        return FALSE;
+
+    roi_width = width - priv->roi_x;
+    roi_height = height - priv->roi_y;
+
+    if (priv->roi_width > 0)
+        roi_width = MIN (roi_width, priv->roi_width);
+
+    if (priv->roi_height > 0)
+        roi_height = MIN (roi_height, priv->roi_height);
+
+    /* Incomplete bins at the right and bottom border are dropped */
+    dims[0] = roi_width / priv->binning;
+    dims[1] = roi_height / priv->binning;
+
+    if (rows != NULL)
+        *rows = (guint32) dims[1] * priv->binning;
+
+    return dims[0] > 0 && dims[1] > 0;
+}
+
+static gboolean
+set_frame_dims (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    if (!get_output_dims (priv, frame->width, frame->height, frame->dims, &frame->rows)) {
+        g_warning ("Region of interest is outside of `%s'", frame->entry->filename);
+        return FALSE;
+    }
+
+    frame->dims[2] = frame->n_pages;
+    return TRUE;
+}
+
+static gboolean
+needs_transform (UfoReaderTaskPrivate *priv)
+{
+    return priv->roi_x > 0 || priv->roi_width > 0 || priv->binning > 1;
+}
+
+static void
+accumulate_row (gconstpointer row, guint16 bps, guint x, guint binning, gsize n, gfloat *acc)
+{
+    if (bps <= 8) {
+        const guint8 *src = ((const guint8 *) row) + x;
+
+        for (gsize i = 0; i < n * binning; i++)
+            acc[i / binning] += (gfloat) src[i];
+    }
+    else if (bps <= 16) {
+        const guint16 *src = ((const guint16 *) row) + x;
+
+        for (gsize i = 0; i < n * binning; i++)
+            acc[i / binning] += (gfloat) src[i];
+    }
+    else {
+        const gfloat *src = ((const gfloat *) row) + x;
+
+        for (gsize i = 0; i < n * binning; i++)
+            acc[i / binning] += src[i];
+    }
+}
+
+/*
+ * Crop the decoded rows horizontally and bin them into float output. Each
+ * output row is accumulated in place from binning input rows.
+ */
+static void
+crop_and_bin (UfoReaderTaskPrivate *priv, ReaderFrame *frame, gconstpointer src, gfloat *dst)
+{
+    const gsize row_size = frame->width * bytes_per_sample (frame->bps);
+    const guint b = priv->binning;
+    const gfloat scale = priv->binning_mode == BINNING_MEAN ? 1.0f / ((gfloat) (b * b)) : 1.0f;
+
+    for (gsize y = 0; y < frame->dims[1]; y++) {
+        gfloat *acc = dst + y * frame->dims[0];
+
+        memset (acc, 0, frame->dims[0] * sizeof (gfloat));
+
+        for (guint i = 0; i < b; i++) {
+            gconstpointer row = ((const gchar *) src) + (y * b + i) * row_size;
+            accumulate_row (row, frame->bps, priv->roi_x, b, frame->dims[0], acc);
+        }
+
+        if (scale != 1.0f) {
+            for (gsize x = 0; x < frame->dims[0]; x++)
+                acc[x] *= scale;
+        }
+    }
+}
+
+/*
+ * Take the metadata from the index instead of opening the file. The caller
+ * has to open the file before reading it.
+ */
+static gboolean
+use_entry_metadata (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    ReaderEntry *entry = frame->entry;
+    guint n_pages = (guint) g_atomic_int_get (&entry->n_pages);
+
+    /* Later pages may differ from the first one */
+    if (entry->width == 0 || n_pages == 0 || frame->page > 0)
+        return FALSE;
+
+    if (!get_output_dims (priv, entry->width, entry->height, frame->dims, &frame->rows))
+        return FALSE;
+
+    frame->tiff = NULL;
+    frame->edf = NULL;
+    frame->width = entry->width;
+    frame->height = entry->height;
+    frame->bps = entry->bps;
+    frame->spp = 1;
+    frame->n_pages = priv->volume ? n_pages : 1;
+    frame->dims[2] = frame->n_pages;
+    return TRUE;
+}
+
+/*
+ * Open the frame's file and read its metadata. On success, the frame dims are
+ * set to the size of the region of interest.
+ */
+static gboolean
+open_frame (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    ReaderEntry *entry = frame->entry;
+    const gchar *name = entry->filename;
+    guint n_pages = 1;
+
+    frame->tiff = NULL;
+    frame->shared_tiff = FALSE;
+    frame->edf = NULL;
+
+    if (is_tiff_file (name)) {
+        frame->tiff = priv->volume ? TIFFOpen (name, "r") : acquire_page_handle (priv, frame);
+
+        if (frame->tiff == NULL) {
+            close_frame (priv, frame);
+            return FALSE;
+        }
+
+        n_pages = (guint) g_atomic_int_get (&entry->n_pages);
+
+        if (n_pages == 0 || priv->volume)
+            n_pages = (guint) TIFFNumberOfDirectories (frame->tiff);
+
+        TIFFGetField (frame->tiff, TIFFTAG_BITSPERSAMPLE, &frame->bps);
+        TIFFGetField (frame->tiff, TIFFTAG_SAMPLESPERPIXEL, &frame->spp);
+        TIFFGetField (frame->tiff, TIFFTAG_IMAGEWIDTH, &frame->width);
+        TIFFGetField (frame->tiff, TIFFTAG_IMAGELENGTH, &frame->height);
+    }
+    else if (is_edf_file (name)) {
+        frame->edf = g_mapped_file_new (name, FALSE, NULL);
+
+        if (frame->edf == NULL)
+            return FALSE;
+
+        if (!read_edf_metadata (priv, frame)) {
+            close_frame (priv, frame);
+            return FALSE;
+        }
+    }
+    else
+        return FALSE;
+
+    frame->n_pages = priv->volume ? n_pages : 1;
+
+    if (!set_frame_dims (priv, frame)) {
+        close_frame (priv, frame);
+        return FALSE;
+    }
+
+    if (frame->page == 0 &&
+        (entry->width != frame->width || entry->height != frame->height ||
+         entry->bps != frame->bps || entry->n_pages != n_pages)) {
+        entry->width = frame->width;
+        entry->height = frame->height;
+        entry->bps = frame->bps;
+        g_atomic_int_set (&entry->n_pages, n_pages);
+        g_atomic_int_set (&priv->index_changed, TRUE);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+page_matches (ReaderFrame *frame)
+{
+    guint32 width = 0;
+    guint32 height = 0;
+    guint16 bps = 0;
+
+    TIFFGetField (frame->tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField (frame->tiff, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField (frame->tiff, TIFFTAG_BITSPERSAMPLE, &bps);
+
+    return width == frame->width && height == frame->height && bps == frame->bps;
+}
+
+/*
+ * Decode the region of interest of the current page into buffer. If the region
+ * is cropped horizontally or binned, the rows are decoded into scratch memory
+ * first and buffer receives float data.
+ */
+static gboolean
+read_page (UfoReaderTaskPrivate *priv, ReaderFrame *frame, gpointer buffer)
+{
+    gboolean success = FALSE;
+    gpointer dst = buffer;
+
+    if (needs_transform (priv)) {
+        frame->scratch = g_realloc (frame->scratch, frame->width * frame->rows * bytes_per_sample (frame->bps));
+        dst = frame->scratch;
+    }
+
+    if (frame->tiff != NULL)
+        success = read_tiff_data (priv, frame, priv->roi_y, dst);
+    else if (frame->edf != NULL)
+        success = read_edf_data (frame, priv->roi_y, dst);
+
+    if (success && dst != buffer)
+        crop_and_bin (priv, frame, dst, buffer);
+
+    return success;
+}
+
+/*
+ * Decode all pages of an opened frame into consecutive slices of buffer and
+ * close the file afterwards.
+ */
+static gboolean
+read_frame (UfoReaderTaskPrivate *priv, ReaderFrame *frame, gpointer buffer)
+{
+    gsize page_size;
+    gboolean success;
+
+    /* Slices are packed with the size of the samples as they are decoded */
+    page_size = frame->dims[0] * frame->dims[1] *
+                (needs_transform (priv) ? sizeof (gfloat) : bytes_per_sample (frame->bps));
+
+    success = read_page (priv, frame, buffer);
 
-#include "ufo-reader-task.h"
+    for (guint i = 1; success && i < frame->n_pages; i++) {
+        success = TIFFReadDirectory (frame->tiff) && page_matches (frame);
 
+        if (success)
+            success = read_page (priv, frame, ((gchar *) buffer) + i * page_size);
+        else
+            g_warning ("Page %u of `%s' differs from the first one", i, frame->entry->filename);
+    }
 
-struct _UfoReaderTaskPrivate {
-    gchar *path;
-    guint count;
-    guint current_count;
-    guint step;
-    guint start;
-    guint end;
-    gboolean blocking;
-    gboolean normalize;
-    gboolean more_pages;
-    GSList *filenames;
-    GSList *current_filename;
+    close_frame (priv, frame);
 
-    FILE *edf;
-    TIFF *tiff;
-    gboolean big_endian;
-    guint32 width;
-    guint32 height;
-    guint16 bps;
-    guint16 spp;
-    gsize size;
-    gboolean enable_conversion;
+    if (success && needs_transform (priv))
+        frame->converted = TRUE;
 
-    guint roi_y;
-    guint roi_height;
-};
+    return success;
+}
 
-static void ufo_task_interface_init (UfoTaskIface *iface);
+/*
+ * Widen 8- and 16-bit data in place. We walk backwards so that the float
+ * results never overwrite integer values that have not been converted yet.
+ */
+static void
+convert_to_float (gpointer data, guint16 bps, gsize n_pixels)
+{
+    gfloat *dst = (gfloat *) data;
 
-G_DEFINE_TYPE_WITH_CODE (UfoReaderTask, ufo_reader_task, UFO_TYPE_TASK_NODE,
-                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
-                                                ufo_task_interface_init))
+    if (bps <= 8) {
+        guint8 *src = (guint8 *) data;
 
-#define UFO_READER_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_READER_TASK, UfoReaderTaskPrivate))
+        for (gsize i = n_pixels; i > 0; i--)
+            dst[i - 1] = (gfloat) src[i - 1];
+    }
+    else if (bps <= 16) {
+        guint16 *src = (guint16 *) data;
 
-enum {
-    PROP_0,
-    PROP_PATH,
-    PROP_BLOCKING,
-    PROP_START,
-    PROP_END,
-    PROP_STEP,
-    PROP_NORMALIZE,
-    PROP_ROI_Y,
-    PROP_ROI_HEIGHT,
-    PROP_TOTAL_HEIGHT,
-    PROP_ENABLE_CONVERSION,
-    N_PROPERTIES
-};
+        for (gsize i = n_pixels; i > 0; i--)
+            dst[i - 1] = (gfloat) src[i - 1];
+    }
+}
 
-static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+static void
+prefetch_frame (ReaderFrame *frame, UfoReaderTaskPrivate *priv)
+{
+    gboolean success;
 
-UfoNode *
-ufo_reader_task_new (void)
+    success = open_frame (priv, frame);
+
+    if (success) {
+        gsize n_pixels = frame->dims[0] * frame->dims[1] * frame->dims[2];
+
+        frame->data = g_realloc (frame->data, n_pixels * sizeof (gfloat));
+        success = read_frame (priv, frame, frame->data);
+
+        /* Integer data is widened after uploading it in device conversion mode */
+        if (success && !frame->converted && frame->bps < 32 &&
+            priv->enable_conversion && !priv->device_conversion) {
+            convert_to_float (frame->data, frame->bps, n_pixels);
+            frame->converted = TRUE;
+        }
+    }
+
+    g_mutex_lock (&priv->lock);
+    frame->success = success;
+    frame->ready = TRUE;
+    g_cond_broadcast (&priv->ready_cond);
+    g_mutex_unlock (&priv->lock);
+}
+
+static ReaderFrame *
+get_frame (UfoReaderTaskPrivate *priv, guint count)
 {
-    return UFO_NODE (g_object_new (UFO_TYPE_READER_TASK, NULL));
+    return &priv->frames[count % priv->n_frames];
 }
 
+/*
+ * Claim the next chunk of files from the counter file shared by all
+ * partitions. The counter is a fixed-width decimal number, so that it can be
+ * overwritten in place while holding a write lock on the file.
+ */
 static gboolean
-read_tiff_data (UfoReaderTaskPrivate *priv, gpointer buffer, UfoRequisition *requisition)
+claim_chunk (UfoReaderTaskPrivate *priv)
 {
-    const guint32 width = requisition->dims[0];
-    const guint32 height = requisition->dims[1];
-    tsize_t result;
-    int offset = 0;
-    int step = width;
+    static GMutex counter_lock;
+    struct flock lock = { 0, };
+    gchar buffer[32] = { 0, };
+    guint claimed = 0;
+    gboolean success = FALSE;
+    int fd;
+
+    /* fcntl locks do not exclude threads of the same process */
+    g_mutex_lock (&counter_lock);
+    fd = open (priv->counter_path, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0) {
+        g_warning ("Could not open counter file `%s'", priv->counter_path);
+        g_mutex_unlock (&counter_lock);
+        return FALSE;
+    }
 
-    if (priv->bps > 8) {
-        if (priv->bps <= 16)
-            step *= 2;
-        else
-            step *= 4;
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+
+    if (fcntl (fd, F_SETLKW, &lock) == 0) {
+        if (read (fd, buffer, sizeof (buffer) - 1) > 0)
+            claimed = (guint) g_ascii_strtoull (buffer, NULL, 10);
+
+        if (claimed < priv->entries->len) {
+            priv->next_entry = claimed;
+            priv->last_entry = MIN (claimed + priv->chunk_size, priv->entries->len);
+
+            g_snprintf (buffer, sizeof (buffer), "%020u\n", priv->last_entry);
+            success = lseek (fd, 0, SEEK_SET) == 0 && write (fd, buffer, 21) == 21;
+            priv->claimed_any = TRUE;
+        }
+        else if (!priv->claimed_any) {
+            g_warning ("Counter file `%s' is exhausted before the first claim, "
+                       "remove it if it is left over from an earlier run", priv->counter_path);
+        }
     }
 
-    for (guint32 i = 0; i < height; i++) {
-        result = TIFFReadScanline (priv->tiff, ((gchar *) buffer) + offset, i + priv->roi_y, 0);
+    close (fd);
+    g_mutex_unlock (&counter_lock);
+    return success;
+}
 
-        if (result == -1)
+static gboolean
+get_next_entry (UfoReaderTaskPrivate *priv, guint *entry)
+{
+    if (priv->next_entry >= priv->last_entry) {
+        if (priv->counter_path == NULL || !claim_chunk (priv))
             return FALSE;
-
-        offset += step;
     }
 
+    *entry = priv->next_entry++;
     return TRUE;
 }
 
-static gboolean
-is_tiff_file (const gchar *filename)
+static ReaderFrame *
+wait_for_frame (UfoReaderTaskPrivate *priv, guint count)
 {
-    return g_str_has_suffix (filename, ".tiff") ||
-           g_str_has_suffix (filename, ".tif");
+    ReaderFrame *frame = get_frame (priv, count);
+
+    g_mutex_lock (&priv->lock);
+
+    while (!frame->ready)
+        g_cond_wait (&priv->ready_cond, &priv->lock);
+
+    g_mutex_unlock (&priv->lock);
+    return frame;
 }
 
-static gboolean
-is_edf_file (const gchar *filename)
+/*
+ * Return the number of pages of entry. Unless the index knows it, opening the
+ * first page counts them, so wait for that instead of opening the file again.
+ */
+static guint
+get_num_pages (UfoReaderTaskPrivate *priv, ReaderEntry *entry)
 {
-    return g_str_has_suffix (filename, ".edf");
+    if (g_atomic_int_get (&entry->n_pages) == 0 &&
+        priv->pool != NULL && priv->page_entry_count >= priv->current_count)
+        wait_for_frame (priv, priv->page_entry_count);
+
+    return MAX (1, (guint) g_atomic_int_get (&entry->n_pages));
 }
 
-static gboolean
-has_valid_extension (const gchar *filename)
+static void
+submit_frame (UfoReaderTaskPrivate *priv)
 {
-    return is_tiff_file (filename) || is_edf_file (filename);
+    ReaderFrame *frame;
+    GError *error = NULL;
+    guint page = 0;
+    guint entry;
+
+    /* In stream mode, every page of a multi-page file is a frame of its own */
+    if (!priv->volume && priv->page_entry != NULL &&
+        priv->next_page < get_num_pages (priv, priv->page_entry)) {
+        page = priv->next_page;
+    }
+    else {
+        if (!get_next_entry (priv, &entry))
+            return;
+
+        priv->page_entry = g_ptr_array_index (priv->entries, entry);
+        priv->page_entry_count = priv->n_submitted;
+    }
+
+    priv->next_page = page + 1;
+
+    frame = get_frame (priv, priv->n_submitted);
+    frame->entry = priv->page_entry;
+    frame->page = page;
+    frame->n_pages = 1;
+    frame->shared_tiff = FALSE;
+    frame->converted = FALSE;
+    frame->ready = FALSE;
+    priv->n_submitted++;
+
+    if (priv->pool != NULL) {
+        g_thread_pool_push (priv->pool, frame, &error);
+
+        if (error != NULL) {
+            g_warning ("Could not prefetch `%s': %s", frame->entry->filename, error->message);
+            g_error_free (error);
+        }
+    }
 }
 
-static GSList *
-read_filenames (UfoReaderTaskPrivate *priv)
+static void
+free_frames (UfoReaderTaskPrivate *priv)
 {
-    GSList *result = NULL;
-    gchar *pattern;
-    glob_t glob_vector;
-    guint i;
-    guint end;
+    if (priv->pool != NULL) {
+        /* Drop frames that have not been started and wait for the others */
+        g_thread_pool_free (priv->pool, TRUE, TRUE);
+        priv->pool = NULL;
+    }
 
-    if (!has_valid_extension (priv->path) && (g_strrstr (priv->path, "*") == NULL))
-        pattern = g_build_filename (priv->path, "*", NULL);
-    else
-        pattern = g_strdup (priv->path);
+    for (guint i = 0; i < priv->n_frames; i++) {
+        close_frame (priv, &priv->frames[i]);
+        g_free (priv->frames[i].data);
+        g_free (priv->frames[i].scratch);
+    }
 
-    glob (pattern, GLOB_MARK | GLOB_TILDE, NULL, &glob_vector);
-    end = priv->end == G_MAXUINT ? (guint) glob_vector.gl_pathc : priv->end;
+    close_cursor (priv);
+    g_free (priv->frames);
+    priv->frames = NULL;
+    priv->n_frames = 0;
+}
 
-    for (i = priv->start; i < end; i+=priv->step) {
-        const gchar *filename = glob_vector.gl_pathv[i];
+static gboolean
+uses_device_conversion (UfoReaderTaskPrivate *priv, ReaderFrame *frame)
+{
+    /* Cropped or binned frames are float already */
+    return priv->device_conversion && priv->enable_conversion &&
+           frame->bps < 32 && !needs_transform (priv);
+}
 
-        if (has_valid_extension (filename))
-            result = g_slist_append (result, g_strdup (filename));
-        else
-            g_warning ("Ignoring `%s'", filename);
+static void
+release_device_memory (UfoReaderTaskPrivate *priv)
+{
+    if (priv->raw_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->raw_mem));
+        priv->raw_mem = NULL;
+        priv->raw_size = 0;
     }
+}
 
-    globfree (&glob_vector);
-    g_free (pattern);
-    return result;
+/*
+ * Upload the integer data of a frame as it is and widen it to float into the
+ * device memory of output.
+ */
+static void
+convert_on_device (UfoTask *task, ReaderFrame *frame, UfoBuffer *output, gsize n_pixels)
+{
+    UfoReaderTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_kernel kernel;
+    cl_mem out_mem;
+    cl_int err;
+    gsize size;
+
+    priv = UFO_READER_TASK_GET_PRIVATE (task);
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    size = n_pixels * bytes_per_sample (frame->bps);
+
+    if (size > priv->raw_size) {
+        release_device_memory (priv);
+        priv->raw_mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY, size, NULL, &err);
+        UFO_RESOURCES_CHECK_CLERR (err);
+        priv->raw_size = size;
+    }
+
+    /* Blocking, because the host memory is reused for the next file right away */
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteBuffer (cmd_queue, priv->raw_mem, CL_TRUE,
+                                                     0, size, frame->data, 0, NULL, NULL));
+
+    kernel = frame->bps <= 8 ? priv->convert_u8_kernel : priv->convert_u16_kernel;
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &priv->raw_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &out_mem));
+    ufo_profiler_call (profiler, cmd_queue, kernel, 1, &n_pixels, NULL);
 }
 
 static void
@@ -171,106 +1336,86 @@ ufo_reader_task_setup (UfoTask *task,
     UfoReaderTaskPrivate *priv;
     guint n_files;
     guint partition;
+    guint remainder;
     guint index;
     guint total;
 
     node = UFO_READER_TASK (task);
     priv = node->priv;
 
-    priv->filenames = read_filenames (priv);
-
     if (priv->end <= priv->start) {
         g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP, "End must be less than start");
         return;
     }
 
-    if (priv->filenames == NULL) {
-        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP, "Path does not match any files");
-        return;
-    }
+    if (priv->device_conversion && priv->context == NULL) {
+        priv->convert_u8_kernel = ufo_resources_get_kernel (resources, "default.cl", "convert_u8_1d", error);
 
-    ufo_task_node_get_partition (UFO_TASK_NODE (task), &index, &total);
-    n_files = (priv->end - priv->start - 1) / priv->step + 1;
-    partition = n_files / total;
-    priv->current_count = index * partition;
-    priv->count = (index + 1) * partition;
-    priv->current_filename = g_slist_nth (priv->filenames, (guint) priv->current_count);
-}
+        if (priv->convert_u8_kernel == NULL)
+            return;
 
-static void
-read_edf_metadata (UfoReaderTaskPrivate *priv)
-{
-    gchar *header = g_malloc (1024);
-    gchar **tokens;
-    size_t num_bytes;
+        priv->convert_u16_kernel = ufo_resources_get_kernel (resources, "default.cl", "convert_u16_1d", error);
 
-    num_bytes = fread (header, 1, 1024, priv->edf);
+        if (priv->convert_u16_kernel == NULL) {
+            priv->convert_u8_kernel = NULL;
+            return;
+        }
 
-    if (num_bytes != 1024) {
-        g_free (header);
-        fclose (priv->edf);
-        return;
+        priv->context = ufo_resources_get_context (resources);
+        UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->convert_u8_kernel));
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->convert_u16_kernel));
     }
 
-    tokens = g_strsplit(header, ";", 0);
-    priv->big_endian = FALSE;
-
-    for (guint i = 0; tokens[i] != NULL; i++) {
-        gchar **key_value = g_strsplit (tokens[i], "=", 0);
-
-        if (g_strcmp0 (g_strstrip (key_value[0]), "Dim_1") == 0)
-            priv->width = (guint) atoi (key_value[1]);
-        else if (g_strcmp0 (g_strstrip (key_value[0]), "Dim_2") == 0)
-            priv->height = (guint) atoi (key_value[1]);
-        else if (g_strcmp0 (g_strstrip (key_value[0]), "Size") == 0)
-            priv->size = (guint) atoi (key_value[1]);
-        else if ((g_strcmp0 (g_strstrip (key_value[0]), "ByteOrder") == 0) &&
-                 (g_strcmp0 (g_strstrip (key_value[1]), "HighByteFirst") == 0))
-            priv->big_endian = TRUE;
+    free_frames (priv);
+    read_index (priv);
 
-        g_strfreev (key_value);
+    if (priv->entries->len == 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP, "Path does not match any files");
+        return;
     }
 
-    g_strfreev(tokens);
-    g_free(header);
-    priv->bps = 32;
-    priv->spp = 1;
-}
-
-static gboolean
-read_edf_data (UfoReaderTaskPrivate *priv,
-               gpointer buffer,
-               UfoRequisition *requisition)
-{
-    gsize file_size;
-    gsize num_bytes;
-    gssize header_size;
-    /* Offset to the first row */
-    gssize offset;
-    /* size of the image cropped by ROI */
-    gsize size;
+    ufo_task_node_get_partition (UFO_TASK_NODE (task), &index, &total);
+    n_files = priv->entries->len;
+
+    if (priv->counter_path == NULL) {
+        /* Spread the remainder over the first partitions, so that every file is read */
+        partition = n_files / total;
+        remainder = n_files % total;
+        priv->next_entry = index * partition + MIN (index, remainder);
+        priv->last_entry = priv->next_entry + partition + (index < remainder ? 1 : 0);
+    }
+    else {
+        /* Chunks are claimed on demand */
+        priv->next_entry = 0;
+        priv->last_entry = 0;
+        priv->claimed_any = FALSE;
+    }
 
-    fseek (priv->edf, 0L, SEEK_END);
-    file_size = (gsize) ftell (priv->edf);
-    header_size = (gssize) (file_size - priv->size);
-    offset = requisition->dims[0] * priv->roi_y * priv->bps / 8;
-    size = requisition->dims[0] * requisition->dims[1] * priv->bps / 8;
-    fseek (priv->edf, header_size + offset, SEEK_SET);
+    priv->page_entry = NULL;
+    priv->next_page = 0;
+    priv->current_count = 0;
 
-    num_bytes = fread (buffer, 1, size, priv->edf);
+    /* Without prefetching, a single frame is opened and read by the pipeline thread */
+    priv->n_frames = MAX (1, priv->n_prefetch);
+    priv->frames = g_new0 (ReaderFrame, priv->n_frames);
+    priv->n_submitted = 0;
 
-    if (num_bytes != size)
-        return FALSE;
+    if (priv->n_prefetch > 0) {
+        GError *tmp_error = NULL;
 
-    if ((G_BYTE_ORDER == G_LITTLE_ENDIAN) && priv->big_endian) {
-        guint32 *data = (guint32 *) buffer;
-        guint n_pixels = requisition->dims[0] * requisition->dims[1];
+        priv->pool = g_thread_pool_new ((GFunc) prefetch_frame, priv,
+                                        (gint) MAX (1, priv->n_threads), TRUE,
+                                        &tmp_error);
 
-        for (guint i = 0; i < n_pixels; i++)
-            data[i] = g_ntohl (data[i]);
+        if (tmp_error != NULL) {
+            g_propagate_error (error, tmp_error);
+            return;
+        }
     }
 
-    return TRUE;
+    for (guint i = 0; i < priv->n_frames; i++)
+        submit_frame (priv);
 }
 
 static void
@@ -282,37 +1427,42 @@ ufo_reader_task_get_requisition (UfoTask *task,
 
     priv = UFO_READER_TASK_GET_PRIVATE (UFO_READER_TASK (task));
 
-    if ((priv->current_count < priv->count) && (priv->current_filename != NULL)) {
-        const gchar *name = (gchar *) priv->current_filename->data;
+    if (priv->current_count < priv->n_submitted) {
+        ReaderFrame *frame;
 
-        if (is_tiff_file (name)) {
-            priv->tiff = TIFFOpen (name, "r");
+        if (priv->pool != NULL) {
+            frame = wait_for_frame (priv, priv->current_count);
+        }
+        else {
+            frame = get_frame (priv, priv->current_count);
 
-            TIFFGetField (priv->tiff, TIFFTAG_BITSPERSAMPLE, &priv->bps);
-            TIFFGetField (priv->tiff, TIFFTAG_SAMPLESPERPIXEL, &priv->spp);
-            TIFFGetField (priv->tiff, TIFFTAG_IMAGEWIDTH, &priv->width);
-            TIFFGetField (priv->tiff, TIFFTAG_IMAGELENGTH, &priv->height);
+            if (!frame->ready) {
+                frame->success = use_entry_metadata (priv, frame) || open_frame (priv, frame);
+                frame->ready = TRUE;
+            }
         }
-        else if (is_edf_file (name)) {
-            priv->edf = fopen (name, "rb");
-            read_edf_metadata (priv);
+
+        if (frame->success) {
+            priv->width = frame->width;
+            priv->height = frame->height;
+            priv->depth = frame->n_pages;
         }
+        else
+            g_warning ("Could not open `%s'", frame->entry->filename);
     }
 
-    requisition->n_dims = 2;
-
-    if (priv->roi_height == 0 && priv->roi_y == 0) {
-        requisition->dims[0] = priv->width;
-        requisition->dims[1] = priv->height;
+    /* Unreadable files keep the dimensions of the last good one */
+    if (!get_output_dims (priv, priv->width, priv->height, requisition->dims, NULL)) {
+        requisition->dims[0] = 1;
+        requisition->dims[1] = 1;
     }
-    else {
-        requisition->dims[0] = priv->width;
 
-        if (priv->roi_height > 0)
-            requisition->dims[1] = MIN (priv->height - priv->roi_y, priv->roi_height);
-        else
-            requisition->dims[1] = priv->height - priv->roi_y;
+    if (priv->volume) {
+        requisition->dims[2] = MAX (1, priv->depth);
+        requisition->n_dims = 3;
     }
+    else
+        requisition->n_dims = 2;
 }
 
 static guint
@@ -331,9 +1481,39 @@ ufo_reader_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_reader_task_get_mode (UfoTask *task)
 {
+    UfoReaderTaskPrivate *priv = UFO_READER_TASK_GET_PRIVATE (task);
+
+    if (priv->device_conversion)
+        return UFO_TASK_MODE_GENERATOR | UFO_TASK_MODE_GPU;
+
     return UFO_TASK_MODE_GENERATOR | UFO_TASK_MODE_CPU;
 }
 
+/*
+ * Open and read a frame in the pipeline thread. The data of frames that cannot
+ * be opened is zeroed.
+ */
+static void
+read_frame_sync (UfoReaderTaskPrivate *priv, ReaderFrame *frame, UfoRequisition *requisition,
+                 gpointer data, gsize size)
+{
+    /* With metadata from the index, the file has not been opened yet */
+    if (frame->tiff == NULL && frame->edf == NULL) {
+        frame->success = open_frame (priv, frame) &&
+                         frame->dims[0] == requisition->dims[0] &&
+                         frame->dims[1] == requisition->dims[1] &&
+                         (!priv->volume || frame->dims[2] == requisition->dims[2]);
+
+        if (!frame->success) {
+            close_frame (priv, frame);
+            memset (data, 0, size);
+        }
+    }
+
+    if (!frame->success || !read_frame (priv, frame, data))
+        g_warning ("Could not read data from `%s'", frame->entry->filename);
+}
+
 static gboolean
 ufo_reader_task_generate (UfoTask *task,
                           UfoBuffer *output,
@@ -345,36 +1525,55 @@ ufo_reader_task_generate (UfoTask *task,
     priv = UFO_READER_TASK_GET_PRIVATE (UFO_READER_TASK (task));
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
 
-    if ((priv->current_count < priv->count) && (priv->current_filename != NULL)) {
-        gpointer data = ufo_buffer_get_host_array (output, NULL);
+    if (priv->current_count < priv->n_submitted) {
+        ReaderFrame *frame = get_frame (priv, priv->current_count);
+        gsize n_pixels = requisition->dims[0] * requisition->dims[1];
 
-        ufo_profiler_start (profiler, UFO_PROFILER_TIMER_IO);
+        if (requisition->n_dims == 3)
+            n_pixels *= requisition->dims[2];
 
-        if (priv->tiff != NULL) {
-            read_tiff_data (priv, data, requisition);
-            TIFFClose (priv->tiff);
-            priv->tiff = NULL;
-        }
-        else if (priv->edf != NULL) {
-            read_edf_data (priv, data, requisition);
-            fclose (priv->edf);
-            priv->edf = NULL;
+        if (frame->success && uses_device_conversion (priv, frame)) {
+            /* Integer data stays on the host until it is uploaded as it is */
+            if (priv->pool == NULL) {
+                gsize size = n_pixels * bytes_per_sample (frame->bps);
+
+                ufo_profiler_start (profiler, UFO_PROFILER_TIMER_IO);
+                frame->data = g_realloc (frame->data, size);
+                read_frame_sync (priv, frame, requisition, frame->data, size);
+                ufo_profiler_stop (profiler, UFO_PROFILER_TIMER_IO);
+            }
+
+            convert_on_device (task, frame, output, n_pixels);
         }
+        else {
+            gpointer data = ufo_buffer_get_host_array (output, NULL);
 
-        ufo_profiler_stop (profiler, UFO_PROFILER_TIMER_IO);
-        ufo_profiler_start (profiler, UFO_PROFILER_TIMER_CPU);
+            ufo_profiler_start (profiler, UFO_PROFILER_TIMER_IO);
 
-        if (priv->bps < 32 && priv->enable_conversion) {
-            UfoBufferDepth depth;
+            if (!frame->success)
+                memset (data, 0, n_pixels * sizeof (gfloat));
+            else if (priv->pool != NULL)
+                memcpy (data, frame->data, n_pixels * sizeof (gfloat));
+            else
+                read_frame_sync (priv, frame, requisition, data, n_pixels * sizeof (gfloat));
 
-            depth = priv->bps <= 8 ? UFO_BUFFER_DEPTH_8U : UFO_BUFFER_DEPTH_16U;
-            ufo_buffer_convert (output, depth);
-        }
+            ufo_profiler_stop (profiler, UFO_PROFILER_TIMER_IO);
+            ufo_profiler_start (profiler, UFO_PROFILER_TIMER_CPU);
+
+            if (frame->success && !frame->converted && frame->bps < 32 && priv->enable_conversion) {
+                UfoBufferDepth depth;
 
-        ufo_profiler_stop (profiler, UFO_PROFILER_TIMER_CPU);
+                depth = frame->bps <= 8 ? UFO_BUFFER_DEPTH_8U : UFO_BUFFER_DEPTH_16U;
+                ufo_buffer_convert (output, depth);
+            }
 
-        priv->current_filename = g_slist_next(priv->current_filename);
+            ufo_profiler_stop (profiler, UFO_PROFILER_TIMER_CPU);
+        }
+
+        /* The slot is free again, hand it to the next file in line */
+        frame->ready = FALSE;
         priv->current_count++;
+        submit_frame (priv);
         return TRUE;
     }
 
@@ -409,6 +1608,21 @@ ufo_reader_task_set_property (GObject *object,
         case PROP_ROI_HEIGHT:
             priv->roi_height = g_value_get_uint (value);
             break;
+        case PROP_ROI_X:
+            priv->roi_x = g_value_get_uint (value);
+            break;
+        case PROP_ROI_WIDTH:
+            priv->roi_width = g_value_get_uint (value);
+            break;
+        case PROP_BINNING:
+            priv->binning = g_value_get_uint (value);
+            break;
+        case PROP_BINNING_MODE:
+            if (!g_strcmp0 (g_value_get_string (value), "sum"))
+                priv->binning_mode = BINNING_SUM;
+            else if (!g_strcmp0 (g_value_get_string (value), "mean"))
+                priv->binning_mode = BINNING_MEAN;
+            break;
         case PROP_ENABLE_CONVERSION:
             priv->enable_conversion = g_value_get_boolean (value);
             break;
@@ -418,6 +1632,32 @@ ufo_reader_task_set_property (GObject *object,
         case PROP_END:
             priv->end = g_value_get_uint (value);
             break;
+        case PROP_NUM_THREADS:
+            priv->n_threads = g_value_get_uint (value);
+            break;
+        case PROP_PREFETCH:
+            priv->n_prefetch = g_value_get_uint (value);
+            break;
+        case PROP_STRIP_THREADS:
+            priv->n_strip_threads = g_value_get_uint (value);
+            break;
+        case PROP_INDEX:
+            g_free (priv->index_path);
+            priv->index_path = g_value_dup_string (value);
+            break;
+        case PROP_COUNTER_FILE:
+            g_free (priv->counter_path);
+            priv->counter_path = g_value_dup_string (value);
+            break;
+        case PROP_CHUNK_SIZE:
+            priv->chunk_size = g_value_get_uint (value);
+            break;
+        case PROP_VOLUME:
+            priv->volume = g_value_get_boolean (value);
+            break;
+        case PROP_DEVICE_CONVERSION:
+            priv->device_conversion = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -451,6 +1691,25 @@ ufo_reader_task_get_property (GObject *object,
         case PROP_ROI_HEIGHT:
             g_value_set_uint (value, priv->roi_height);
             break;
+        case PROP_ROI_X:
+            g_value_set_uint (value, priv->roi_x);
+            break;
+        case PROP_ROI_WIDTH:
+            g_value_set_uint (value, priv->roi_width);
+            break;
+        case PROP_BINNING:
+            g_value_set_uint (value, priv->binning);
+            break;
+        case PROP_BINNING_MODE:
+            switch (priv->binning_mode) {
+                case BINNING_SUM:
+                    g_value_set_string (value, "sum");
+                    break;
+                case BINNING_MEAN:
+                    g_value_set_string (value, "mean");
+                    break;
+            }
+            break;
         case PROP_TOTAL_HEIGHT:
             g_value_set_uint (value, priv->height);
             break;
@@ -463,6 +1722,30 @@ ufo_reader_task_get_property (GObject *object,
         case PROP_END:
             g_value_set_uint (value, priv->end);
             break;
+        case PROP_NUM_THREADS:
+            g_value_set_uint (value, priv->n_threads);
+            break;
+        case PROP_PREFETCH:
+            g_value_set_uint (value, priv->n_prefetch);
+            break;
+        case PROP_STRIP_THREADS:
+            g_value_set_uint (value, priv->n_strip_threads);
+            break;
+        case PROP_INDEX:
+            g_value_set_string (value, priv->index_path);
+            break;
+        case PROP_COUNTER_FILE:
+            g_value_set_string (value, priv->counter_path);
+            break;
+        case PROP_CHUNK_SIZE:
+            g_value_set_uint (value, priv->chunk_size);
+            break;
+        case PROP_VOLUME:
+            g_value_set_boolean (value, priv->volume);
+            break;
+        case PROP_DEVICE_CONVERSION:
+            g_value_set_boolean (value, priv->device_conversion);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -474,13 +1757,36 @@ ufo_reader_task_finalize (GObject *object)
 {
     UfoReaderTaskPrivate *priv = UFO_READER_TASK_GET_PRIVATE (object);
 
+    free_frames (priv);
+    g_mutex_clear (&priv->lock);
+    g_cond_clear (&priv->ready_cond);
+    g_cond_clear (&priv->cursor_cond);
+
     g_free (priv->path);
     priv->path = NULL;
 
-    if (priv->filenames != NULL) {
-        g_slist_foreach (priv->filenames, (GFunc) g_free, NULL);
-        g_slist_free (priv->filenames);
-        priv->filenames = NULL;
+    free_index (priv);
+    g_free (priv->index_path);
+    priv->index_path = NULL;
+
+    g_free (priv->counter_path);
+    priv->counter_path = NULL;
+
+    release_device_memory (priv);
+
+    if (priv->convert_u8_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->convert_u8_kernel));
+        priv->convert_u8_kernel = NULL;
+    }
+
+    if (priv->convert_u16_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->convert_u16_kernel));
+        priv->convert_u16_kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
     }
 
     G_OBJECT_CLASS (ufo_reader_task_parent_class)->finalize (object);
@@ -548,6 +1854,34 @@ ufo_reader_task_class_init(UfoReaderTaskClass *klass)
             0, G_MAXUINT, 0,
             G_PARAM_READWRITE);
 
+    properties[PROP_ROI_X] =
+        g_param_spec_uint("x",
+            "Horizontal coordinate",
+            "Horizontal coordinate from where to start reading the image",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ROI_WIDTH] =
+        g_param_spec_uint("width",
+            "Width",
+            "Width of the region of interest to read",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BINNING] =
+        g_param_spec_uint("binning",
+            "Binning factor",
+            "Number of pixels in x and y direction that are combined into one while reading",
+            1, 64, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BINNING_MODE] =
+        g_param_spec_string("binning-mode",
+            "Binning mode",
+            "Binning mode from: \"sum\", \"mean\"",
+            "mean",
+            G_PARAM_READWRITE);
+
     properties[PROP_TOTAL_HEIGHT] =
         g_param_spec_uint("total-height",
             "Total height of an image",
@@ -576,6 +1910,62 @@ ufo_reader_task_class_init(UfoReaderTaskClass *klass)
             1, G_MAXUINT, G_MAXUINT,
             G_PARAM_READWRITE);
 
+    properties[PROP_NUM_THREADS] =
+        g_param_spec_uint("num-threads",
+            "Number of decoding threads",
+            "Number of threads that decode prefetched files",
+            1, 64, 2,
+            G_PARAM_READWRITE);
+
+    properties[PROP_PREFETCH] =
+        g_param_spec_uint("prefetch",
+            "Number of files decoded ahead",
+            "Number of files that are decoded ahead of time, 0 disables prefetching",
+            0, 1024, 4,
+            G_PARAM_READWRITE);
+
+    properties[PROP_STRIP_THREADS] =
+        g_param_spec_uint("strip-threads",
+            "Number of threads decoding a single file",
+            "Number of threads that decode the strips or tiles of a compressed TIFF file in parallel",
+            1, 64, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_INDEX] =
+        g_param_spec_string("index",
+            "Path of the file index",
+            "Path of a file that caches the list of matching files and their dimensions between runs",
+            NULL,
+            G_PARAM_READWRITE);
+
+    properties[PROP_COUNTER_FILE] =
+        g_param_spec_string("counter-file",
+            "Path of a shared counter file",
+            "Path of a counter file from which partitions claim chunks of files dynamically",
+            NULL,
+            G_PARAM_READWRITE);
+
+    properties[PROP_CHUNK_SIZE] =
+        g_param_spec_uint("chunk-size",
+            "Number of files claimed at once",
+            "Number of files a partition claims at once from the counter file",
+            1, G_MAXUINT, 16,
+            G_PARAM_READWRITE);
+
+    properties[PROP_VOLUME] =
+        g_param_spec_boolean("volume",
+            "Read multi-page files as volumes",
+            "Read all pages of a multi-page TIFF file into one three-dimensional buffer instead of a stream of pages",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_DEVICE_CONVERSION] =
+        g_param_spec_boolean("device-conversion",
+            "Convert integer data on the device",
+            "Upload 8- and 16-bit data as it is and convert it to float on the device",
+            FALSE,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -592,12 +1982,43 @@ ufo_reader_task_init(UfoReaderTask *self)
     priv->step = 1;
     priv->blocking = FALSE;
     priv->normalize = FALSE;
-    priv->more_pages = FALSE;
+    priv->volume = FALSE;
+    priv->roi_x = 0;
     priv->roi_y = 0;
+    priv->roi_width = 0;
     priv->roi_height = 0;
-    priv->tiff = NULL;
-    priv->edf = NULL;
+    priv->binning = 1;
+    priv->binning_mode = BINNING_MEAN;
     priv->enable_conversion = TRUE;
     priv->start = 0;
     priv->end = G_MAXUINT;
+    priv->width = 0;
+    priv->height = 0;
+    priv->depth = 1;
+    priv->n_threads = 2;
+    priv->n_prefetch = 4;
+    priv->n_strip_threads = 1;
+    priv->index_path = NULL;
+    priv->pattern = NULL;
+    priv->index = NULL;
+    priv->entries = NULL;
+    priv->counter_path = NULL;
+    priv->chunk_size = 16;
+    priv->pool = NULL;
+    priv->frames = NULL;
+    priv->n_frames = 0;
+    priv->cursor_tiff = NULL;
+    priv->cursor_entry = NULL;
+    priv->cursor_busy = FALSE;
+    priv->edf_header.file_size = 0;
+    priv->device_conversion = FALSE;
+    priv->context = NULL;
+    priv->convert_u8_kernel = NULL;
+    priv->convert_u16_kernel = NULL;
+    priv->raw_mem = NULL;
+    priv->raw_size = 0;
+
+    g_mutex_init (&priv->lock);
+    g_cond_init (&priv->ready_cond);
+    g_cond_init (&priv->cursor_cond);
 }
@@ -17,23 +17,95 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _XOPEN_SOURCE 600
+
+#include "config.h"
+
 #include <gmodule.h>
 #include <tiffio.h>
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "ufo-writer-task.h"
 
 
+/*
+ * A copy of one input that is waiting to be written by one of the writer
+ * threads. Items are recycled through a queue of free items, which bounds the
+ * memory used for pending writes.
+ */
+typedef struct {
+    gpointer data;
+    gsize size;
+    UfoRequisition requisition;
+    guint counter;
+} WriterItem;
+
+/*
+ * Tag values and sizes of the pages of one input, computed once and applied
+ * to each directory.
+ */
+typedef struct {
+    guint32 width;
+    guint32 height;
+    guint32 rows_per_strip;
+    gsize strip_size;
+    gsize page_size;
+} PageLayout;
+
 struct _UfoWriterTaskPrivate {
     gchar *format;
     gchar *template;
     guint counter;
     gboolean append;
+    gboolean resume;
+    GHashTable *written;
+    gchar *manifest_path;
+    FILE *manifest;
+    GMutex manifest_lock;
     gsize width;
     gsize height;
 
     gboolean single;
+    gboolean bigtiff;
+    guint flush_interval;
+    guint n_pages_written;
     TIFF *tif;
+
+    gboolean raw;
+    guint depth;
+    int fd;
+    gchar *map;
+    gsize map_size;
+    gsize slice_size;
+
+    guint16 compression;
+    guint rows_per_strip;
+
+    guint bits;
+    gfloat minimum;
+    gfloat maximum;
+    gfloat percentile;
+    guint scale_frames;
+    gboolean have_limits;
+    gfloat lower;
+    gfloat upper;
+    GPtrArray *pending;
+    gpointer scratch;
+
+    guint queue_size;
+    guint n_threads;
+    GThreadPool *pool;
+    GAsyncQueue *free_items;
+    gint failed;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -49,6 +121,20 @@ enum {
     PROP_FORMAT,
     PROP_SINGLE_FILE,
     PROP_APPEND,
+    PROP_RESUME,
+    PROP_BIGTIFF,
+    PROP_FLUSH_INTERVAL,
+    PROP_RAW,
+    PROP_DEPTH,
+    PROP_COMPRESSION,
+    PROP_ROWS_PER_STRIP,
+    PROP_BITS,
+    PROP_MINIMUM,
+    PROP_MAXIMUM,
+    PROP_PERCENTILE,
+    PROP_SCALE_FRAMES,
+    PROP_QUEUE_SIZE,
+    PROP_NUM_THREADS,
     N_PROPERTIES
 };
 
@@ -60,61 +146,154 @@ ufo_writer_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_WRITER_TASK, NULL));
 }
 
+#ifdef HAVE_ZLIB
+/*
+ * Deflate all strips of a page in parallel and write them serially as raw
+ * strips. libtiff would compress one strip after the other.
+ */
 static gboolean
-write_tiff_data (UfoWriterTaskPrivate *priv, UfoBuffer *buffer)
+write_deflated_strips (TIFF *tif, const gchar *data, gsize strip_size, gsize page_size, guint n_strips)
 {
-    UfoRequisition requisition;
-    guint32 rows_per_strip;
+    Bytef **buffers;
+    uLongf *sizes;
     gboolean success = TRUE;
-    gpointer data;
-    guint n_pages;
-    guint width, height;
 
-    ufo_buffer_get_requisition (buffer, &requisition);
+    buffers = g_new0 (Bytef *, n_strips);
+    sizes = g_new0 (uLongf, n_strips);
 
-    /* With a 3-dimensional input buffer, we create z-depth TIFF pages. */
-    n_pages = requisition.n_dims == 3 ? (guint) requisition.dims[2] : 1;
+#pragma omp parallel for reduction(&&:success)
+    for (guint i = 0; i < n_strips; i++) {
+        uLong size = (uLong) MIN (strip_size, page_size - i * strip_size);
+
+        sizes[i] = compressBound (size);
+        buffers[i] = g_malloc (sizes[i]);
+
+        if (compress2 (buffers[i], &sizes[i], (const Bytef *) data + i * strip_size,
+                       size, Z_DEFAULT_COMPRESSION) != Z_OK)
+            success = FALSE;
+    }
+
+    for (guint i = 0; success && i < n_strips; i++)
+        success = TIFFWriteRawStrip (tif, i, buffers[i], (tmsize_t) sizes[i]) != -1;
+
+    for (guint i = 0; i < n_strips; i++)
+        g_free (buffers[i]);
+
+    g_free (buffers);
+    g_free (sizes);
+    return success;
+}
+#endif
+
+static gboolean
+write_strips (UfoWriterTaskPrivate *priv, TIFF *tif, gchar *data, gsize strip_size, gsize page_size)
+{
+    guint n_strips = (guint) ((page_size + strip_size - 1) / strip_size);
+    gboolean success = TRUE;
+
+#ifdef HAVE_ZLIB
+    if (priv->compression == COMPRESSION_ADOBE_DEFLATE && n_strips > 1)
+        return write_deflated_strips (tif, data, strip_size, page_size, n_strips);
+#endif
+
+    for (guint i = 0; success && i < n_strips; i++) {
+        gsize size = MIN (strip_size, page_size - i * strip_size);
+        success = TIFFWriteEncodedStrip (tif, i, data + i * strip_size, (tmsize_t) size) != -1;
+    }
+
+    return success;
+}
+
+static gsize
+bytes_per_sample (guint bits)
+{
+    return bits / 8;
+}
+
+static void
+compute_layout (UfoWriterTaskPrivate *priv, UfoRequisition *requisition, PageLayout *layout)
+{
+    gsize row_size;
+
+    layout->width = (guint32) requisition->dims[0];
+    layout->height = (guint32) requisition->dims[1];
+    row_size = layout->width * bytes_per_sample (priv->bits);
+
+    /* Without a fixed size, strips hold about 8 KB like libtiff's default */
+    if (priv->rows_per_strip > 0)
+        layout->rows_per_strip = MIN (priv->rows_per_strip, layout->height);
+    else
+        layout->rows_per_strip = (guint32) CLAMP (8192 / row_size, 1, layout->height);
+
+    layout->strip_size = layout->rows_per_strip * row_size;
+    layout->page_size = layout->height * row_size;
+}
+
+/*
+ * libtiff forgets all tags once a directory is written, so they have to be set
+ * again for every page.
+ */
+static void
+set_page_tags (UfoWriterTaskPrivate *priv, TIFF *tif, PageLayout *layout, guint page, guint n_pages)
+{
+    if (n_pages != 1)
+        TIFFSetField (tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+
+    TIFFSetField (tif, TIFFTAG_IMAGEWIDTH, layout->width);
+    TIFFSetField (tif, TIFFTAG_IMAGELENGTH, layout->height);
+    TIFFSetField (tif, TIFFTAG_BITSPERSAMPLE, priv->bits);
+    TIFFSetField (tif, TIFFTAG_SAMPLEFORMAT, priv->bits == 32 ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT);
+    TIFFSetField (tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField (tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField (tif, TIFFTAG_COMPRESSION, priv->compression);
+    TIFFSetField (tif, TIFFTAG_ROWSPERSTRIP, layout->rows_per_strip);
+    TIFFSetField (tif, TIFFTAG_PAGENUMBER, page, n_pages);
+}
 
-    width = (guint) requisition.dims[0];
-    height = (guint) requisition.dims[1];
-    data = ufo_buffer_get_host_array (buffer, NULL);
+static gboolean
+write_tiff_data (UfoWriterTaskPrivate *priv, TIFF *tif, gpointer data, UfoRequisition *requisition)
+{
+    PageLayout layout;
+    gboolean success = TRUE;
+    guint n_pages;
 
-    rows_per_strip = TIFFDefaultStripSize (priv->tif, (guint32) - 1);
+    /* With a 3-dimensional input buffer, we create z-depth TIFF pages. */
+    n_pages = requisition->n_dims == 3 ? (guint) requisition->dims[2] : 1;
+    compute_layout (priv, requisition, &layout);
 
-    if (n_pages > 1)
-        TIFFSetField (priv->tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+    for (guint i = 0; success && i < n_pages; i++) {
+        gchar *start = ((gchar *) data) + i * layout.page_size;
 
-    for (guint i = 0; i < n_pages; i++) {
-        gfloat *start;
+        /* A single file is one volume whose total number of pages is unknown */
+        if (priv->single)
+            set_page_tags (priv, tif, &layout, priv->n_pages_written, 0);
+        else
+            set_page_tags (priv, tif, &layout, i, n_pages);
 
-        TIFFSetField (priv->tif, TIFFTAG_IMAGEWIDTH, width);
-        TIFFSetField (priv->tif, TIFFTAG_IMAGELENGTH, height);
-        TIFFSetField (priv->tif, TIFFTAG_BITSPERSAMPLE, 32);
-        TIFFSetField (priv->tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
-        TIFFSetField (priv->tif, TIFFTAG_SAMPLESPERPIXEL, 1);
-        TIFFSetField (priv->tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-        TIFFSetField (priv->tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
-        TIFFSetField (priv->tif, TIFFTAG_PAGENUMBER, i, n_pages);
-        start = ((gfloat *) data) + i * width * height;
+        success = write_strips (priv, tif, start, layout.strip_size, layout.page_size) &&
+                  TIFFWriteDirectory (tif);
 
-        for (guint y = 0; y < height; y++, start += width)
-            TIFFWriteScanline (priv->tif, start, y, 0);
+        if (priv->single) {
+            priv->n_pages_written++;
 
-        TIFFWriteDirectory (priv->tif);
+            /* Keep the amount of unwritten data bounded on large volumes */
+            if (priv->flush_interval > 0 && (priv->n_pages_written % priv->flush_interval) == 0)
+                success = success && TIFFFlush (tif) && fsync (TIFFFileno (tif)) == 0;
+        }
     }
 
     return success;
 }
 
 static gchar *
-build_filename (UfoWriterTaskPrivate *priv)
+build_filename (UfoWriterTaskPrivate *priv, guint counter)
 {
     gchar *filename;
 
     if (priv->single)
         filename = g_strdup (priv->format);
     else
-        filename = g_strdup_printf (priv->template, priv->counter);
+        filename = g_strdup_printf (priv->template, counter);
 
     return filename;
 }
@@ -122,9 +301,229 @@ build_filename (UfoWriterTaskPrivate *priv)
 static void
 find_free_index (UfoWriterTaskPrivate *priv)
 {
-    while (g_file_test(build_filename(priv), G_FILE_TEST_EXISTS)) {
+    while (g_hash_table_contains (priv->written, GUINT_TO_POINTER (priv->counter + 1)))
         priv->counter++;
+}
+
+static gboolean
+is_written (UfoWriterTaskPrivate *priv, guint counter)
+{
+    return priv->written != NULL &&
+           g_hash_table_contains (priv->written, GUINT_TO_POINTER (counter + 1));
+}
+
+static void
+mark_written (GHashTable *written, guint counter)
+{
+    /* Offset by one because index 0 would be a NULL key */
+    g_hash_table_insert (written, GUINT_TO_POINTER (counter + 1), GUINT_TO_POINTER (counter + 1));
+}
+
+/*
+ * Split the file name part of the template into the text before and after
+ * the counter specifier.
+ */
+static gboolean
+split_template (const gchar *template, gchar **prefix, gchar **suffix)
+{
+    gchar *basename;
+    gchar *percent;
+    gchar *spec;
+    gboolean found = FALSE;
+
+    basename = g_path_get_basename (template);
+    percent = strchr (basename, '%');
+
+    if (percent != NULL) {
+        for (spec = percent + 1; *spec != '\0' && strchr ("diu", *spec) == NULL; spec++)
+            ;
+
+        if (*spec != '\0') {
+            *prefix = g_strndup (basename, (gsize) (percent - basename));
+            *suffix = g_strdup (spec + 1);
+            found = TRUE;
+        }
+    }
+
+    g_free (basename);
+    return found;
+}
+
+static gboolean
+parse_index (const gchar *name, const gchar *prefix, const gchar *suffix, guint *index)
+{
+    const gchar *digits;
+    gchar *end;
+    guint64 value;
+    gsize length;
+
+    length = strlen (name);
+
+    if (length <= strlen (prefix) + strlen (suffix) ||
+        !g_str_has_prefix (name, prefix) || !g_str_has_suffix (name, suffix))
+        return FALSE;
+
+    digits = name + strlen (prefix);
+
+    if (!g_ascii_isdigit (*digits))
+        return FALSE;
+
+    value = g_ascii_strtoull (digits, &end, 10);
+
+    if (end != name + length - strlen (suffix) || value >= G_MAXUINT)
+        return FALSE;
+
+    *index = (guint) value;
+    return TRUE;
+}
+
+/*
+ * Collect the indices of all files in the output directory that match the
+ * template with a single directory scan.
+ */
+static void
+scan_directory (UfoWriterTaskPrivate *priv, const gchar *dirname)
+{
+    GDir *dir;
+    const gchar *name;
+    gchar *prefix;
+    gchar *suffix;
+    guint index;
+
+    if (!split_template (priv->template, &prefix, &suffix)) {
+        g_warning ("Cannot find the counter in `%s'", priv->template);
+        return;
     }
+
+    dir = g_dir_open (dirname, 0, NULL);
+
+    if (dir != NULL) {
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            if (parse_index (name, prefix, suffix, &index))
+                mark_written (priv->written, index);
+        }
+
+        g_dir_close (dir);
+    }
+
+    g_free (prefix);
+    g_free (suffix);
+}
+
+static gchar *
+build_manifest_path (UfoWriterTaskPrivate *priv, const gchar *dirname)
+{
+    gchar *prefix;
+    gchar *suffix;
+    gchar *path;
+
+    if (!split_template (priv->template, &prefix, &suffix))
+        return g_build_filename (dirname, ".index", NULL);
+
+    path = g_strdup_printf ("%s/.%sindex", dirname, prefix);
+    g_free (prefix);
+    g_free (suffix);
+    return path;
+}
+
+static void
+close_manifest (UfoWriterTaskPrivate *priv)
+{
+    if (priv->manifest != NULL) {
+        fclose (priv->manifest);
+        priv->manifest = NULL;
+    }
+
+    if (priv->written != NULL) {
+        g_hash_table_destroy (priv->written);
+        priv->written = NULL;
+    }
+
+    g_free (priv->manifest_path);
+    priv->manifest_path = NULL;
+}
+
+/*
+ * The manifest lists the index of every completely written file, one per
+ * line. It is read instead of scanning the directory and, unlike the
+ * directory, never contains files that were cut off by an interrupted run.
+ */
+static void
+open_manifest (UfoWriterTaskPrivate *priv, const gchar *dirname)
+{
+    gchar *contents;
+
+    priv->manifest_path = build_manifest_path (priv, dirname);
+    priv->written = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    if (g_file_get_contents (priv->manifest_path, &contents, NULL, NULL)) {
+        gchar **lines;
+
+        lines = g_strsplit (contents, "\n", -1);
+
+        for (guint i = 0; lines[i] != NULL; i++) {
+            gchar *end;
+            guint64 index;
+
+            index = g_ascii_strtoull (lines[i], &end, 10);
+
+            if (end != lines[i] && index < G_MAXUINT)
+                mark_written (priv->written, (guint) index);
+        }
+
+        g_strfreev (lines);
+        g_free (contents);
+        priv->manifest = fopen (priv->manifest_path, "a");
+    }
+    else {
+        GHashTableIter iter;
+        gpointer key;
+
+        /* Seed a new manifest with whatever was written before */
+        scan_directory (priv, dirname);
+        priv->manifest = fopen (priv->manifest_path, "w");
+
+        if (priv->manifest != NULL) {
+            g_hash_table_iter_init (&iter, priv->written);
+
+            while (g_hash_table_iter_next (&iter, &key, NULL))
+                fprintf (priv->manifest, "%u\n", GPOINTER_TO_UINT (key) - 1);
+
+            fflush (priv->manifest);
+        }
+    }
+
+    if (priv->manifest == NULL)
+        g_warning ("Could not open `%s': %s", priv->manifest_path, g_strerror (errno));
+}
+
+/*
+ * A run that overwrites the sequence starts with an empty manifest, so that a
+ * later run with resume knows which files it finished. Only the first
+ * partition truncates it, a record that is lost to this race merely causes
+ * the file to be written again.
+ */
+static void
+create_manifest (UfoWriterTaskPrivate *priv, const gchar *dirname, guint partition)
+{
+    priv->manifest_path = build_manifest_path (priv, dirname);
+    priv->written = g_hash_table_new (g_direct_hash, g_direct_equal);
+    priv->manifest = fopen (priv->manifest_path, partition == 0 ? "w" : "a");
+
+    if (priv->manifest == NULL)
+        g_warning ("Could not open `%s': %s", priv->manifest_path, g_strerror (errno));
+}
+
+static void
+record_written (UfoWriterTaskPrivate *priv, guint counter)
+{
+    if (priv->manifest == NULL)
+        return;
+
+    g_mutex_lock (&priv->manifest_lock);
+    fprintf (priv->manifest, "%u\n", counter);
+    fflush (priv->manifest);
+    g_mutex_unlock (&priv->manifest_lock);
 }
 
 static gchar *
@@ -154,15 +553,376 @@ build_template (const gchar *format)
     return template;
 }
 
-static void
-open_tiff_file (UfoWriterTaskPrivate *priv)
+static TIFF *
+open_tiff_file (UfoWriterTaskPrivate *priv, guint counter)
 {
+    TIFF *tif;
     gchar *filename;
-    const gchar *mode = priv->append ? "a" : "w";
+    const gchar *mode;
+
+    if (priv->bigtiff)
+        mode = priv->append ? "a8" : "w8";
+    else
+        mode = priv->append ? "a" : "w";
+
+    filename = build_filename (priv, counter);
+    tif = TIFFOpen (filename, mode);
+
+    if (tif == NULL)
+        g_warning ("Could not open `%s'", filename);
 
-    filename = build_filename (priv);
-    priv->tif = TIFFOpen (filename, mode);
     g_free (filename);
+    return tif;
+}
+
+static gboolean
+write_data (UfoWriterTaskPrivate *priv, gpointer data, UfoRequisition *requisition, guint counter)
+{
+    TIFF *tif;
+    gboolean success;
+
+    if (priv->single)
+        return priv->tif != NULL && write_tiff_data (priv, priv->tif, data, requisition);
+
+    tif = open_tiff_file (priv, counter);
+
+    if (tif == NULL)
+        return FALSE;
+
+    success = write_tiff_data (priv, tif, data, requisition);
+    TIFFClose (tif);
+
+    if (success)
+        record_written (priv, counter);
+
+    return success;
+}
+
+/*
+ * Scale float data linearly from [lower, upper] to the full range of the
+ * output type. Values outside are clipped, NaNs become 0.
+ */
+static void
+convert_data (UfoWriterTaskPrivate *priv, const gfloat *src, gpointer dst, gsize n)
+{
+    const gfloat max_value = priv->bits == 8 ? 255.0f : 65535.0f;
+    const gfloat lower = priv->lower;
+    const gfloat scale = priv->upper > lower ? max_value / (priv->upper - lower) : 0.0f;
+
+    if (priv->bits == 8) {
+        guint8 *out = (guint8 *) dst;
+
+#pragma omp simd
+        for (gsize i = 0; i < n; i++) {
+            gfloat v = (src[i] - lower) * scale;
+            out[i] = (guint8) ((v > 0.0f ? (v < max_value ? v : max_value) : 0.0f) + 0.5f);
+        }
+    }
+    else {
+        guint16 *out = (guint16 *) dst;
+
+#pragma omp simd
+        for (gsize i = 0; i < n; i++) {
+            gfloat v = (src[i] - lower) * scale;
+            out[i] = (guint16) ((v > 0.0f ? (v < max_value ? v : max_value) : 0.0f) + 0.5f);
+        }
+    }
+}
+
+static void
+write_item (WriterItem *item, UfoWriterTaskPrivate *priv)
+{
+    if (!write_data (priv, item->data, &item->requisition, item->counter))
+        g_atomic_int_set (&priv->failed, TRUE);
+
+    g_async_queue_push (priv->free_items, item);
+}
+
+static void
+free_item (WriterItem *item)
+{
+    g_free (item->data);
+    g_free (item);
+}
+
+/*
+ * Wait until all pending items are written and release the writer threads.
+ */
+static void
+flush_items (UfoWriterTaskPrivate *priv)
+{
+    WriterItem *item;
+
+    if (priv->pool != NULL) {
+        g_thread_pool_free (priv->pool, FALSE, TRUE);
+        priv->pool = NULL;
+    }
+
+    if (priv->free_items != NULL) {
+        while ((item = g_async_queue_try_pop (priv->free_items)) != NULL)
+            free_item (item);
+
+        g_async_queue_unref (priv->free_items);
+        priv->free_items = NULL;
+    }
+}
+
+/*
+ * Grow the raw file to the size of the whole volume and map it. Every
+ * partition maps the whole file but only writes its own slices.
+ */
+static gboolean
+map_raw_file (UfoWriterTaskPrivate *priv, gsize slice_size)
+{
+    gsize size = slice_size * priv->depth;
+    int err;
+
+    err = posix_fallocate (priv->fd, 0, (off_t) size);
+
+    if (err != 0) {
+        g_warning ("Could not allocate `%s': %s", priv->format, g_strerror (err));
+        return FALSE;
+    }
+
+    priv->map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, priv->fd, 0);
+
+    if (priv->map == MAP_FAILED) {
+        g_warning ("Could not map `%s': %s", priv->format, g_strerror (errno));
+        priv->map = NULL;
+        return FALSE;
+    }
+
+    priv->map_size = size;
+    priv->slice_size = slice_size;
+    return TRUE;
+}
+
+static void
+close_raw_file (UfoWriterTaskPrivate *priv)
+{
+    if (priv->map != NULL) {
+        munmap (priv->map, priv->map_size);
+        priv->map = NULL;
+    }
+
+    if (priv->fd >= 0) {
+        close (priv->fd);
+        priv->fd = -1;
+    }
+}
+
+/*
+ * Place the slices of an input at their index in the raw volume.
+ */
+static gboolean
+write_raw (UfoWriterTaskPrivate *priv, gpointer data, UfoRequisition *requisition, guint counter)
+{
+    gsize n_slices = requisition->n_dims == 3 ? requisition->dims[2] : 1;
+    gsize n_pixels = requisition->dims[0] * requisition->dims[1];
+    gsize slice_size = n_pixels * bytes_per_sample (priv->bits);
+    gchar *dst;
+
+    if (priv->map == NULL && !map_raw_file (priv, slice_size))
+        return FALSE;
+
+    if (slice_size != priv->slice_size) {
+        g_warning ("Slice size differs from the first one");
+        return FALSE;
+    }
+
+    if (counter + n_slices > priv->depth) {
+        g_warning ("Slice %u is outside of the volume", (guint) (counter + n_slices - 1));
+        return FALSE;
+    }
+
+    dst = priv->map + counter * slice_size;
+
+    if (priv->bits < 32)
+        convert_data (priv, data, dst, n_pixels * n_slices);
+    else
+        memcpy (dst, data, n_slices * slice_size);
+
+    return TRUE;
+}
+
+/*
+ * Convert or copy data into an item and queue it or write it right away.
+ */
+static gboolean
+write_frame (UfoWriterTaskPrivate *priv, gpointer data, UfoRequisition *requisition, guint counter)
+{
+    gsize n_pixels = requisition->dims[0] * requisition->dims[1];
+    gsize size;
+    gboolean success = TRUE;
+
+    /* Raw volumes are written into mapped memory, there is nothing to queue */
+    if (priv->raw)
+        return write_raw (priv, data, requisition, counter);
+
+    /* Finished files of an interrupted run are kept as they are */
+    if (priv->resume && is_written (priv, counter))
+        return TRUE;
+
+    if (requisition->n_dims == 3)
+        n_pixels *= requisition->dims[2];
+
+    size = n_pixels * bytes_per_sample (priv->bits);
+
+    if (priv->pool != NULL) {
+        WriterItem *item;
+        GError *error = NULL;
+
+        /* Blocks while all items are waiting to be written */
+        item = g_async_queue_pop (priv->free_items);
+
+        if (item->size < size) {
+            g_free (item->data);
+            item->data = g_malloc (size);
+            item->size = size;
+        }
+
+        if (priv->bits < 32)
+            convert_data (priv, data, item->data, n_pixels);
+        else
+            memcpy (item->data, data, size);
+
+        item->requisition = *requisition;
+        item->counter = counter;
+        g_thread_pool_push (priv->pool, item, &error);
+
+        if (error != NULL) {
+            g_warning ("Could not queue data: %s", error->message);
+            g_error_free (error);
+            g_async_queue_push (priv->free_items, item);
+            success = FALSE;
+        }
+
+        /* Errors of earlier writes are reported as soon as we know about them */
+        success = success && !g_atomic_int_get (&priv->failed);
+    }
+    else if (priv->bits < 32) {
+        priv->scratch = g_realloc (priv->scratch, size);
+        convert_data (priv, data, priv->scratch, n_pixels);
+        success = write_data (priv, priv->scratch, requisition, counter);
+    }
+    else {
+        success = write_data (priv, data, requisition, counter);
+    }
+
+    return success;
+}
+
+static void
+find_range (const gfloat *data, gsize n, gfloat *lower, gfloat *upper)
+{
+    gfloat lo = *lower;
+    gfloat hi = *upper;
+
+    /* Written such that NaNs are skipped */
+#pragma omp simd reduction(min:lo) reduction(max:hi)
+    for (gsize i = 0; i < n; i++) {
+        lo = data[i] < lo ? data[i] : lo;
+        hi = data[i] > hi ? data[i] : hi;
+    }
+
+    *lower = lo;
+    *upper = hi;
+}
+
+/*
+ * Narrow the range of the pending frames to the given percentile at both ends
+ * by means of a histogram.
+ */
+#define N_BINS 65536
+
+static void
+clip_percentile (UfoWriterTaskPrivate *priv)
+{
+    guint64 *histogram;
+    guint64 total = 0;
+    guint64 sum = 0;
+    guint64 threshold;
+    gfloat scale;
+    guint lower_bin = 0;
+    guint upper_bin = N_BINS - 1;
+
+    if (priv->upper <= priv->lower)
+        return;
+
+    histogram = g_new0 (guint64, N_BINS);
+    scale = (N_BINS - 1) / (priv->upper - priv->lower);
+
+    for (guint i = 0; i < priv->pending->len; i++) {
+        WriterItem *item = g_ptr_array_index (priv->pending, i);
+        const gfloat *data = item->data;
+        gsize n = item->size / sizeof (gfloat);
+
+        for (gsize j = 0; j < n; j++) {
+            if (data[j] >= priv->lower && data[j] <= priv->upper) {
+                histogram[(guint) ((data[j] - priv->lower) * scale)]++;
+                total++;
+            }
+        }
+    }
+
+    threshold = (guint64) (total * priv->percentile / 100.0f);
+
+    for (sum = 0; lower_bin < N_BINS - 1 && sum + histogram[lower_bin] <= threshold; lower_bin++)
+        sum += histogram[lower_bin];
+
+    for (sum = 0; upper_bin > lower_bin && sum + histogram[upper_bin] <= threshold; upper_bin--)
+        sum += histogram[upper_bin];
+
+    priv->upper = priv->lower + (upper_bin + 1) / scale;
+    priv->lower = priv->lower + lower_bin / scale;
+    g_free (histogram);
+}
+
+/*
+ * Determine the scaling limits from the pending frames and write them.
+ */
+static gboolean
+flush_pending (UfoWriterTaskPrivate *priv)
+{
+    gboolean success = TRUE;
+
+    if (priv->percentile > 0.0f)
+        clip_percentile (priv);
+
+    priv->have_limits = TRUE;
+
+    for (guint i = 0; i < priv->pending->len; i++) {
+        WriterItem *item = g_ptr_array_index (priv->pending, i);
+        success = write_frame (priv, item->data, &item->requisition, item->counter) && success;
+    }
+
+    g_ptr_array_set_size (priv->pending, 0);
+    return success;
+}
+
+/*
+ * Keep a copy of a frame until the limits are known. Only the first
+ * scale-frames frames are kept, all later ones are scaled right away.
+ */
+static gboolean
+defer_frame (UfoWriterTaskPrivate *priv, gpointer data, UfoRequisition *requisition, gsize size)
+{
+    WriterItem *item;
+
+    item = g_new0 (WriterItem, 1);
+    item->data = g_malloc (size);
+    memcpy (item->data, data, size);
+    item->size = size;
+    item->requisition = *requisition;
+    item->counter = priv->counter;
+    g_ptr_array_add (priv->pending, item);
+
+    find_range (item->data, size / sizeof (gfloat), &priv->lower, &priv->upper);
+
+    if (priv->pending->len >= priv->scale_frames)
+        return flush_pending (priv);
+
+    return TRUE;
 }
 
 static void
@@ -176,10 +936,58 @@ ufo_writer_task_setup (UfoTask *task,
 
     priv = UFO_WRITER_TASK_GET_PRIVATE (task);
     ufo_task_node_get_partition (UFO_TASK_NODE (task), &index, &total);
-    priv->counter = index * 1000;
 
-    if (priv->single) {
-        open_tiff_file (priv);
+    /*
+     * With a known depth, partitions receive the same balanced share of the
+     * inputs as the reader hands out. Otherwise we can only leave room for
+     * 1000 files per partition.
+     */
+    if (priv->depth > 0)
+        priv->counter = index * (priv->depth / total) + MIN (index, priv->depth % total);
+    else
+        priv->counter = index * 1000;
+
+    priv->failed = FALSE;
+    priv->n_pages_written = 0;
+    flush_items (priv);
+    close_raw_file (priv);
+    close_manifest (priv);
+    g_ptr_array_set_size (priv->pending, 0);
+
+    if (priv->minimum < priv->maximum) {
+        priv->lower = priv->minimum;
+        priv->upper = priv->maximum;
+        priv->have_limits = TRUE;
+    }
+    else {
+        priv->lower = G_MAXFLOAT;
+        priv->upper = -G_MAXFLOAT;
+        priv->have_limits = FALSE;
+    }
+
+    if (priv->compression != COMPRESSION_NONE && !TIFFIsCODECConfigured (priv->compression)) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "libtiff does not support the requested compression");
+        return;
+    }
+
+    if (priv->raw) {
+        if (priv->depth == 0) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                         "Depth must be set to write a raw volume");
+            return;
+        }
+
+        priv->fd = open (priv->format, O_RDWR | O_CREAT, 0644);
+
+        if (priv->fd < 0) {
+            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                         "Could not open `%s'", priv->format);
+            return;
+        }
+    }
+    else if (priv->single) {
+        priv->tif = open_tiff_file (priv, priv->counter);
     }
     else {
         gchar *dirname;
@@ -197,12 +1005,35 @@ ufo_writer_task_setup (UfoTask *task,
             }
         }
 
-        if (priv->append) {
-            find_free_index(priv);
+        if (priv->append || priv->resume) {
+            open_manifest (priv, dirname);
+
+            if (priv->append)
+                find_free_index (priv);
+        }
+        else {
+            create_manifest (priv, dirname, index);
         }
 
         g_free (dirname);
     }
+
+    if (priv->queue_size > 0 && !priv->raw) {
+        GError *tmp_error = NULL;
+
+        priv->free_items = g_async_queue_new ();
+
+        for (guint i = 0; i < priv->queue_size; i++)
+            g_async_queue_push (priv->free_items, g_new0 (WriterItem, 1));
+
+        /* Pages of a single file must be written in order */
+        priv->pool = g_thread_pool_new ((GFunc) write_item, priv,
+                                        priv->single ? 1 : (gint) priv->n_threads, TRUE,
+                                        &tmp_error);
+
+        if (tmp_error != NULL)
+            g_propagate_error (error, tmp_error);
+    }
 }
 
 static void
@@ -241,25 +1072,32 @@ ufo_writer_task_process (UfoTask *task,
 {
     UfoWriterTaskPrivate *priv;
     UfoProfiler *profiler;
+    UfoRequisition in_req;
+    gpointer data;
+    gboolean success = TRUE;
 
     priv = UFO_WRITER_TASK_GET_PRIVATE (UFO_WRITER_TASK (task));
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
 
-    ufo_profiler_start (profiler, UFO_PROFILER_TIMER_IO);
-
-    if (!priv->single)
-        open_tiff_file (priv);
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+    data = ufo_buffer_get_host_array (inputs[0], NULL);
 
-    if (!write_tiff_data (priv, inputs[0]))
-        return FALSE;
+    ufo_profiler_start (profiler, UFO_PROFILER_TIMER_IO);
 
-    if (!priv->single)
-        TIFFClose (priv->tif);
+    if (priv->bits < 32 && !priv->have_limits)
+        success = defer_frame (priv, data, &in_req, ufo_buffer_get_size (inputs[0]));
+    else
+        success = write_frame (priv, data, &in_req, priv->counter);
 
     ufo_profiler_stop (profiler, UFO_PROFILER_TIMER_IO);
 
-    priv->counter++;
-    return TRUE;
+    /* Slices of a raw volume are counted individually */
+    if (priv->raw && in_req.n_dims == 3)
+        priv->counter += (guint) in_req.dims[2];
+    else
+        priv->counter++;
+
+    return success;
 }
 
 static void
@@ -281,6 +1119,62 @@ ufo_writer_task_set_property (GObject *object,
         case PROP_APPEND:
             priv->append = g_value_get_boolean (value);
             break;
+        case PROP_RESUME:
+            priv->resume = g_value_get_boolean (value);
+            break;
+        case PROP_BIGTIFF:
+            priv->bigtiff = g_value_get_boolean (value);
+            break;
+        case PROP_RAW:
+            priv->raw = g_value_get_boolean (value);
+            break;
+        case PROP_DEPTH:
+            priv->depth = g_value_get_uint (value);
+            break;
+        case PROP_FLUSH_INTERVAL:
+            priv->flush_interval = g_value_get_uint (value);
+            break;
+        case PROP_COMPRESSION:
+            if (!g_strcmp0 (g_value_get_string (value), "none"))
+                priv->compression = COMPRESSION_NONE;
+            else if (!g_strcmp0 (g_value_get_string (value), "deflate"))
+                priv->compression = COMPRESSION_ADOBE_DEFLATE;
+            else if (!g_strcmp0 (g_value_get_string (value), "lzw"))
+                priv->compression = COMPRESSION_LZW;
+#ifdef COMPRESSION_ZSTD
+            else if (!g_strcmp0 (g_value_get_string (value), "zstd"))
+                priv->compression = COMPRESSION_ZSTD;
+#endif
+            else
+                g_warning ("Unknown compression `%s'", g_value_get_string (value));
+            break;
+        case PROP_ROWS_PER_STRIP:
+            priv->rows_per_strip = g_value_get_uint (value);
+            break;
+        case PROP_BITS:
+            if (g_value_get_uint (value) != 8 && g_value_get_uint (value) != 16 && g_value_get_uint (value) != 32)
+                g_warning ("Bits must be 8, 16 or 32");
+            else
+                priv->bits = g_value_get_uint (value);
+            break;
+        case PROP_MINIMUM:
+            priv->minimum = g_value_get_float (value);
+            break;
+        case PROP_MAXIMUM:
+            priv->maximum = g_value_get_float (value);
+            break;
+        case PROP_PERCENTILE:
+            priv->percentile = g_value_get_float (value);
+            break;
+        case PROP_SCALE_FRAMES:
+            priv->scale_frames = g_value_get_uint (value);
+            break;
+        case PROP_QUEUE_SIZE:
+            priv->queue_size = g_value_get_uint (value);
+            break;
+        case PROP_NUM_THREADS:
+            priv->n_threads = g_value_get_uint (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -305,6 +1199,63 @@ ufo_writer_task_get_property (GObject *object,
         case PROP_APPEND:
             g_value_set_boolean (value, priv->append);
             break;
+        case PROP_RESUME:
+            g_value_set_boolean (value, priv->resume);
+            break;
+        case PROP_BIGTIFF:
+            g_value_set_boolean (value, priv->bigtiff);
+            break;
+        case PROP_RAW:
+            g_value_set_boolean (value, priv->raw);
+            break;
+        case PROP_DEPTH:
+            g_value_set_uint (value, priv->depth);
+            break;
+        case PROP_FLUSH_INTERVAL:
+            g_value_set_uint (value, priv->flush_interval);
+            break;
+        case PROP_COMPRESSION:
+            switch (priv->compression) {
+                case COMPRESSION_ADOBE_DEFLATE:
+                    g_value_set_string (value, "deflate");
+                    break;
+                case COMPRESSION_LZW:
+                    g_value_set_string (value, "lzw");
+                    break;
+#ifdef COMPRESSION_ZSTD
+                case COMPRESSION_ZSTD:
+                    g_value_set_string (value, "zstd");
+                    break;
+#endif
+                default:
+                    g_value_set_string (value, "none");
+                    break;
+            }
+            break;
+        case PROP_ROWS_PER_STRIP:
+            g_value_set_uint (value, priv->rows_per_strip);
+            break;
+        case PROP_BITS:
+            g_value_set_uint (value, priv->bits);
+            break;
+        case PROP_MINIMUM:
+            g_value_set_float (value, priv->minimum);
+            break;
+        case PROP_MAXIMUM:
+            g_value_set_float (value, priv->maximum);
+            break;
+        case PROP_PERCENTILE:
+            g_value_set_float (value, priv->percentile);
+            break;
+        case PROP_SCALE_FRAMES:
+            g_value_set_uint (value, priv->scale_frames);
+            break;
+        case PROP_QUEUE_SIZE:
+            g_value_set_uint (value, priv->queue_size);
+            break;
+        case PROP_NUM_THREADS:
+            g_value_set_uint (value, priv->n_threads);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -318,10 +1269,21 @@ ufo_writer_task_finalize (GObject *object)
 
     priv = UFO_WRITER_TASK_GET_PRIVATE (object);
 
+    /* Frames kept for scaling and pending writes must finish before the file is closed */
+    if (priv->pending->len > 0)
+        flush_pending (priv);
+
+    flush_items (priv);
+    close_raw_file (priv);
+    close_manifest (priv);
+    g_mutex_clear (&priv->manifest_lock);
+    g_ptr_array_free (priv->pending, TRUE);
+    g_free (priv->scratch);
+
     if (priv->template)
         g_free (priv->template);
 
-    if (priv->single)
+    if (priv->single && priv->tif != NULL)
         TIFFClose (priv->tif);
 
     g_free (priv->format);
@@ -371,6 +1333,104 @@ ufo_writer_task_class_init (UfoWriterTaskClass *klass)
             FALSE,
             G_PARAM_READWRITE);
 
+    properties[PROP_RESUME] =
+        g_param_spec_boolean ("resume",
+            "Skip inputs whose file has already been written",
+            "Skip inputs whose file has already been written",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BIGTIFF] =
+        g_param_spec_boolean ("bigtiff",
+            "Write BigTIFF files",
+            "Write BigTIFF files, which are not limited to 4 GB",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_FLUSH_INTERVAL] =
+        g_param_spec_uint ("flush-interval",
+            "Number of pages after which a single file is flushed",
+            "Number of pages after which a single file is flushed to the storage, if 0 it is only flushed when closed",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RAW] =
+        g_param_spec_boolean ("raw",
+            "Write a raw volume",
+            "Write all slices into one preallocated raw file instead of TIFF",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_DEPTH] =
+        g_param_spec_uint ("depth",
+            "Number of slices of the whole volume",
+            "Number of slices of the whole volume, required for raw volumes and used to partition the output index",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_COMPRESSION] =
+        g_param_spec_string ("compression",
+            "Compression",
+            "Compression from: \"none\", \"deflate\", \"lzw\", \"zstd\"",
+            "none",
+            G_PARAM_READWRITE);
+
+    properties[PROP_ROWS_PER_STRIP] =
+        g_param_spec_uint ("rows-per-strip",
+            "Number of rows per strip",
+            "Number of rows per strip, if 0 libtiff's default is used",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BITS] =
+        g_param_spec_uint ("bits",
+            "Number of bits per sample",
+            "Number of bits per sample, 8 and 16 bits are unsigned integers scaled between the limits, 32 bits are floats",
+            8, 32, 32,
+            G_PARAM_READWRITE);
+
+    properties[PROP_MINIMUM] =
+        g_param_spec_float ("minimum",
+            "Lower scaling limit",
+            "Value mapped to 0 for integer output, limits are computed if minimum is not less than maximum",
+            -G_MAXFLOAT, G_MAXFLOAT, 0.0f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_MAXIMUM] =
+        g_param_spec_float ("maximum",
+            "Upper scaling limit",
+            "Value mapped to the largest integer, limits are computed if minimum is not less than maximum",
+            -G_MAXFLOAT, G_MAXFLOAT, 0.0f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_PERCENTILE] =
+        g_param_spec_float ("percentile",
+            "Percentile clipped at both ends",
+            "Percentage of values that are clipped at each end of the computed limits",
+            0.0f, 50.0f, 0.0f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_SCALE_FRAMES] =
+        g_param_spec_uint ("scale-frames",
+            "Number of frames used to compute the limits",
+            "Number of frames that are kept to compute the limits before anything is written",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_QUEUE_SIZE] =
+        g_param_spec_uint ("queue-size",
+            "Number of inputs that are queued for writing",
+            "Number of inputs that are copied and queued for writing in the background. If 0, inputs are written synchronously",
+            0, 1024, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_NUM_THREADS] =
+        g_param_spec_uint ("num-threads",
+            "Number of writer threads",
+            "Number of threads writing queued inputs, a single file is always written by one thread",
+            1, 64, 1,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -385,5 +1445,34 @@ ufo_writer_task_init(UfoWriterTask *self)
     self->priv->template = NULL;
     self->priv->counter = 0;
     self->priv->append = FALSE;
+    self->priv->resume = FALSE;
+    self->priv->written = NULL;
+    self->priv->manifest_path = NULL;
+    self->priv->manifest = NULL;
+    g_mutex_init (&self->priv->manifest_lock);
     self->priv->single = FALSE;
+    self->priv->tif = NULL;
+    self->priv->bigtiff = FALSE;
+    self->priv->flush_interval = 0;
+    self->priv->n_pages_written = 0;
+    self->priv->raw = FALSE;
+    self->priv->depth = 0;
+    self->priv->fd = -1;
+    self->priv->map = NULL;
+    self->priv->map_size = 0;
+    self->priv->slice_size = 0;
+    self->priv->compression = COMPRESSION_NONE;
+    self->priv->rows_per_strip = 0;
+    self->priv->bits = 32;
+    self->priv->minimum = 0.0f;
+    self->priv->maximum = 0.0f;
+    self->priv->percentile = 0.0f;
+    self->priv->scale_frames = 1;
+    self->priv->pending = g_ptr_array_new_with_free_func ((GDestroyNotify) free_item);
+    self->priv->scratch = NULL;
+    self->priv->queue_size = 0;
+    self->priv->n_threads = 1;
+    self->priv->pool = NULL;
+    self->priv->free_items = NULL;
+    self->priv->failed = FALSE;
 }
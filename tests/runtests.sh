@@ -35,4 +35,9 @@ fi
 
 echo "* Running tests ..."
 export CUDA_VISIBLE_DEVICES=0,1
+
+# Keep tuned work group sizes out of the cache of the user
+export XDG_CACHE_HOME=$(mktemp -d)
+trap 'rm -rf "$XDG_CACHE_HOME"' EXIT
+
 nosetests tests.py
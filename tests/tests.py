@@ -1,12 +1,23 @@
+import atexit
+import ConfigParser
 import os
 import shutil
+import subprocess
+import sys
 import tempfile
+import textwrap
 
 try:
     import unittest2 as unittest
 except ImportError:
     import unittest
 
+# Tuned work group sizes must not end up in the cache of the user. GLib reads
+# the location only once, so it is set before the first plugin is loaded.
+_cache_dir = tempfile.mkdtemp()
+os.environ['XDG_CACHE_HOME'] = _cache_dir
+atexit.register(shutil.rmtree, _cache_dir, True)
+
 import numpy as np
 from nose_parameterized import parameterized
 from gi.repository import Ufo
@@ -74,6 +85,83 @@ class BasicTests(unittest.TestCase):
         self.assertEqual(res_img.shape, ref_img.shape)
         self.assertTrue((res_img == ref_img).all())
 
+    @parameterized.expand([('mean',), ('sum',)])
+    def test_read_crop_binning(self, mode):
+        R = {'x': 3, 'y': 5, 'width': 101, 'height': 67}
+        binning = 4
+        input_name = data_path('sinogram-00005.tif')
+        output_name = self.tmp_path('bin-00000.tif')
+
+        reader = self.get_task('reader', path=input_name, binning=binning, binning_mode=mode, **R)
+        writer = self.get_task('writer', filename=self.tmp_path('bin-%05i.tif'))
+
+        self.graph.connect_nodes(reader, writer)
+        self.sched.run(self.graph)
+
+        # Incomplete bins at the right and bottom border are dropped
+        height = R['height'] // binning
+        width = R['width'] // binning
+        ref_img = TIFF.open(input_name, mode='r').read_image().astype(np.float64)
+        ref_img = ref_img[R['y']:R['y'] + height * binning, R['x']:R['x'] + width * binning]
+        ref_img = ref_img.reshape(height, binning, width, binning).sum(axis=(1, 3))
+
+        if mode == 'mean':
+            ref_img /= binning * binning
+
+        res_img = TIFF.open(output_name, mode='r').read_image()
+        self.assertEqual(res_img.shape, (height, width))
+        self.assertTrue(np.allclose(res_img, ref_img, rtol=1e-5, atol=1e-5))
+
+    def test_raw_reader_slabs(self):
+        volume = np.random.random((10, 16, 32)).astype(np.float32)
+        input_name = self.tmp_path('volume.raw')
+        volume.tofile(input_name)
+
+        reader = self.get_task('raw-reader', path=input_name, width=32, height=16,
+                               start=1, end=10, slab=4)
+        writer = self.get_task('writer', filename=self.tmp_path('slab-%05i.tif'))
+
+        self.graph.connect_nodes(reader, writer)
+        self.sched.run(self.graph)
+
+        # Nine slices are read as two full slabs and a short last one
+        names = sorted(n for n in os.listdir(self.tmpdir) if n.startswith('slab-'))
+        slabs = [list(TIFF.open(self.tmp_path(n), mode='r').iter_images()) for n in names]
+        self.assertEqual([len(slab) for slab in slabs], [4, 4, 1])
+
+        slices = [page for slab in slabs for page in slab]
+        self.assertTrue((np.array(slices) == volume[1:10]).all())
+
+    @parameterized.expand([(8, np.uint8), (16, np.uint16)])
+    def test_write_scaled(self, bits, dtype):
+        input_name = data_path('sinogram-00005.tif')
+        ref_img = TIFF.open(input_name, mode='r').read_image()
+        max_value = np.iinfo(dtype).max
+        lower, upper = np.percentile(ref_img, (10, 90))
+
+        # Fixed limits and limits clipped at one percent at both ends
+        for name, kwargs in (('fixed', dict(minimum=lower, maximum=upper)),
+                             ('clipped', dict(percentile=1.0))):
+            graph = Ufo.TaskGraph()
+            reader = self.get_task('reader', path=input_name)
+            writer = self.get_task('writer', filename=self.tmp_path(name + '-%05i.tif'),
+                                   bits=bits, **kwargs)
+
+            graph.connect_nodes(reader, writer)
+            Ufo.Scheduler().run(graph)
+
+        res_img = TIFF.open(self.tmp_path('fixed-00000.tif'), mode='r').read_image()
+        expected = np.clip((ref_img - lower) * max_value / (upper - lower), 0, max_value)
+        self.assertEqual(res_img.dtype, dtype)
+        self.assertLessEqual(np.max(np.abs(res_img - np.round(expected))), 1)
+
+        res_img = TIFF.open(self.tmp_path('clipped-00000.tif'), mode='r').read_image()
+        self.assertEqual(res_img.dtype, dtype)
+
+        for clipped in (np.mean(res_img == 0), np.mean(res_img == max_value)):
+            self.assertGreater(clipped, 0.005)
+            self.assertLess(clipped, 0.02)
+
     @parameterized.expand([(1, 0.5), (2, 0.5)])
     def test_fft(self, dimension, expected):
         input_name = data_path('sinogram-00005.tif')
@@ -94,6 +182,61 @@ class BasicTests(unittest.TestCase):
         diff = np.sum(np.abs(ref_img - res_img))
         self.assertLess(diff, expected)
 
+    @parameterized.expand([(128,), (127,)])
+    def test_fft_pack_rows(self, height):
+        input_name = data_path('sinogram-00005.tif')
+        results = []
+
+        for pack_rows in (False, True):
+            graph = Ufo.TaskGraph()
+            output_name = self.tmp_path('p%i-%%05i.tif' % pack_rows)
+            reader = self.get_task('reader', path=input_name)
+            roi = self.get_task('region-of-interest', x=0, y=0, width=512, height=height)
+            fft = self.get_task('fft', dimensions=1, pack_rows=pack_rows)
+            ifft = self.get_task('ifft', dimensions=1, pack_rows=pack_rows,
+                                 crop_width=512, crop_height=height)
+            writer = self.get_task('writer', filename=output_name)
+
+            graph.connect_nodes(reader, roi)
+            graph.connect_nodes(roi, fft)
+            graph.connect_nodes(fft, ifft)
+            graph.connect_nodes(ifft, writer)
+            Ufo.Scheduler().run(graph)
+            results.append(TIFF.open(output_name % 0, mode='r').read_image())
+
+        unpacked, packed = results
+        self.assertEqual(packed.shape, (height, 512))
+        self.assertEqual(packed.shape, unpacked.shape)
+        self.assertLess(np.max(np.abs(packed - unpacked)), 1e-3 * np.max(np.abs(unpacked)))
+
+    @parameterized.expand([('ramp',), ('butterworth',)])
+    def test_fbp_filter(self, filter_type):
+        input_name = data_path('sinogram-00005.tif')
+        R = {'x': 0, 'y': 0, 'width': 512, 'height': 127}
+
+        def run(name, *tasks):
+            graph = Ufo.TaskGraph()
+            reader = self.get_task('reader', path=input_name)
+            roi = self.get_task('region-of-interest', **R)
+            writer = self.get_task('writer', filename=self.tmp_path(name + '-%05i.tif'))
+            chain = [reader, roi] + list(tasks) + [writer]
+
+            for source, dest in zip(chain, chain[1:]):
+                graph.connect_nodes(source, dest)
+
+            Ufo.Scheduler().run(graph)
+            return TIFF.open(self.tmp_path(name + '-00000.tif'), mode='r').read_image()
+
+        fused = run('fused', self.get_task('fbp-filter', filter=filter_type))
+        chained = run('chained',
+                      self.get_task('fft', dimensions=1),
+                      self.get_task('filter', filter=filter_type),
+                      self.get_task('ifft', dimensions=1))
+
+        self.assertEqual(fused.shape, (R['height'], R['width']))
+        self.assertEqual(fused.shape, chained.shape)
+        self.assertLess(np.max(np.abs(fused - chained)), 1e-3 * np.max(np.abs(chained)))
+
     def test_flatfield_correction(self):
         input_name = data_path('sinogram-*.tif')
         output_name = self.tmp_path('r-%i.tif')
@@ -114,6 +257,70 @@ class BasicTests(unittest.TestCase):
         self.graph.connect_nodes(ffc, writer)
         self.sched.run(self.graph)
 
+    def test_backproject_cpu(self):
+        input_name = data_path('sinogram-00005.tif')
+        results = []
+
+        for mode in ('nearest', 'cpu'):
+            graph = Ufo.TaskGraph()
+            reader = self.get_task('reader', path=input_name)
+            bp = self.get_task('backproject', mode=mode, circular_mask=False)
+            writer = self.get_task('writer', filename=self.tmp_path(mode + '-%05i.tif'))
+
+            graph.connect_nodes(reader, bp)
+            graph.connect_nodes(bp, writer)
+            Ufo.Scheduler().run(graph)
+            results.append(TIFF.open(self.tmp_path(mode + '-00000.tif'), mode='r').read_image())
+
+        gpu, cpu = results
+        self.assertEqual(gpu.shape, cpu.shape)
+        self.assertLess(np.max(np.abs(gpu - cpu)), 1e-4 * np.max(np.abs(gpu)))
+
+    def test_autotune_cache(self):
+        cache_dir = self.tmp_path('cache')
+        cache_name = os.path.join(cache_dir, 'ufo', 'work-groups')
+
+        # Each run is a new process that starts with the cache left by the previous one
+        script = textwrap.dedent("""
+            import sys
+            from gi.repository import Ufo
+
+            pm = Ufo.PluginManager()
+            graph = Ufo.TaskGraph()
+            tasks = [pm.get_task(name) for name in ('reader', 'gaussian-blur', 'fft', 'filter', 'ifft', 'null')]
+            tasks[0].set_properties(path=sys.argv[1])
+            tasks[1].set_properties(size=5, sigma=1)
+
+            for source, dest in zip(tasks, tasks[1:]):
+                graph.connect_nodes(source, dest)
+
+            Ufo.Scheduler().run(graph)
+            """)
+
+        def run():
+            env = dict(os.environ, XDG_CACHE_HOME=cache_dir)
+            subprocess.check_call([sys.executable, '-c', script, data_path('sinogram-00005.tif')], env=env)
+
+        def read_entries():
+            parser = ConfigParser.RawConfigParser()
+            parser.optionxform = str
+            parser.read(cache_name)
+            return dict(((section, key), value) for section in parser.sections()
+                        for key, value in parser.items(section))
+
+        self.assertFalse(os.path.exists(cache_name))
+
+        # Both plugins store their sizes in the same new file
+        run()
+        self.assertTrue(os.path.exists(cache_name))
+        entries = read_entries()
+        kernels = set(key.split('-')[0] for _, key in entries)
+        self.assertTrue(set(['h_gaussian', 'v_gaussian', 'filter']) <= kernels)
+
+        # Stored sizes are looked up instead of being tuned again
+        run()
+        self.assertEqual(read_entries(), entries)
+
     # def test_filtered_backprojection(self):
     #     reader = self.get_task('reader', path=data_path('sinogram*.tif'))
     #     fft = self.get_task('fft')